@@ -108,14 +108,24 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * The page at ts_vaddr in the address space ts_as, whose ASID
+	 * was ts_asid in ASID generation ts_asidgen. The address space
+	 * may be gone by the time the target CPU gets to this, so ts_as
+	 * is only ever compared, never followed.
 	 */
-	struct addrspace *ts_addrspace;
+	struct addrspace *ts_as;
+	unsigned ts_asid;
+	unsigned ts_asidgen;
 	vaddr_t ts_vaddr;
 };
 
+/* ts_vaddr for "the address space has given up ts_asid" */
+#define TLBSHOOTDOWN_RETIRE ((vaddr_t)1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
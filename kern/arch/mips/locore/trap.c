@@ -39,6 +39,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include "opt-A2.h"
 
 
 /* in exception.S */
@@ -194,6 +195,19 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+#if OPT_A2
+		if (!iskern) {
+			/*
+			 * Back to user mode; check for _exit first. That
+			 * may sleep, so turn interrupts back on to match
+			 * the stored state, which must be spl 0 here.
+			 */
+			KASSERT(doadjust);
+			spl = splhigh();
+			splx(spl);
+			goto exitcheck;
+		}
+#endif /* OPT_A2 */
 		goto done2;
 	}
 
@@ -221,7 +235,7 @@ mips_trap(struct trapframe *tf)
 		      tf->tf_v0, tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3);
 
 		syscall(tf);
-		goto done;
+		goto exitcheck;
 	}
 
 	/*
@@ -232,17 +246,17 @@ mips_trap(struct trapframe *tf)
 	switch (code) {
 	case EX_MOD:
 		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
-			goto done;
+			goto exitcheck;
 		}
 		break;
 	case EX_TLBL:
 		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
-			goto done;
+			goto exitcheck;
 		}
 		break;
 	case EX_TLBS:
 		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
-			goto done;
+			goto exitcheck;
 		}
 		break;
 	case EX_IBE:
@@ -272,7 +286,7 @@ mips_trap(struct trapframe *tf)
 		 * Kill the current user process.
 		 */
 		kill_curthread(tf->tf_epc, code, tf->tf_vaddr);
-		goto done;
+		goto exitcheck;
 	}
 
 	/*
@@ -313,6 +327,18 @@ mips_trap(struct trapframe *tf)
 
 	panic("I can't handle this... I think I'll just die now...\n");
 
+ exitcheck:
+#if OPT_A2
+	/*
+	 * If another thread of this process has called _exit, leave
+	 * instead of going back to user mode. Interrupts are still on
+	 * here, as they must be for that to sleep.
+	 */
+	if (!iskern) {
+		proc_exitcheck();
+	}
+#endif /* OPT_A2 */
+
  done:
 	/*
 	 * Turn interrupts off on the processor, without affecting the
@@ -109,6 +109,11 @@ syscall(struct trapframe *tf)
 					(userptr_t)tf->tf_a1);
 			break;
 
+	  case SYS_nanosleep:
+			err = sys_nanosleep((userptr_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+			break;
+
 #ifdef UW
 		case SYS_write:
 		  err = sys_write((int)tf->tf_a0,
@@ -144,6 +149,36 @@ syscall(struct trapframe *tf)
 		case SYS_fork:
 		  err = sys_fork(tf, (pid_t *)&retval);
 		  break;
+
+		case SYS___thread_create:
+		  err = sys___thread_create(tf, (userptr_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1,
+					    (userptr_t)tf->tf_a2,
+					    (int *)&retval);
+		  break;
+
+		case SYS_thread_exit:
+		  sys_thread_exit((int)tf->tf_a0);
+		  /* does not return */
+		  panic("unexpected return from sys_thread_exit");
+		  break;
+
+		case SYS_thread_join:
+		  err = sys_thread_join((int)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+		  break;
+
+		case SYS_futex_wait:
+		  err = sys_futex_wait((userptr_t)tf->tf_a0,
+				       (int)tf->tf_a1,
+				       (userptr_t)tf->tf_a2);
+		  break;
+
+		case SYS_futex_wake:
+		  err = sys_futex_wake((userptr_t)tf->tf_a0,
+				       (int)tf->tf_a1,
+				       (int *)&retval);
+		  break;
 #endif /* OPT_A2 */
 
 		default:
@@ -199,3 +234,23 @@ enter_forked_process(void *tf, unsigned long data)
 	(void)tf;
 #endif /* OPT_A2 */
 }
+
+#if OPT_A2
+/*
+ * Start user thread TID of the current process, using the trapframe
+ * sys___thread_create made for it.
+ */
+void
+enter_new_thread(void *tf, unsigned long tid)
+{
+	struct trapframe local_tf = *(struct trapframe *)tf;
+	kfree(tf);
+
+	curthread->t_tid = tid;
+
+	/* The process may have started exiting since we were made */
+	proc_exitcheck();
+
+	mips_usermode(&local_tf);
+}
+#endif /* OPT_A2 */
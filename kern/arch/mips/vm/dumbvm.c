@@ -34,77 +34,1635 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A2
+#include <copyinout.h>
+#endif /* OPT_A2 */
+#if OPT_A3
+#include <uio.h>
+#include <vnode.h>
+#include <wchan.h>
+#include <synch.h>
+#include <swap.h>
+#include <workqueue.h>
+#include <uw-vmstats.h>
+#endif /* OPT_A3 */
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
  */
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+#if OPT_A3
+/*
+ * User stacks start out one page long and grow down on demand, up to
+ * 1M. Growing stops short of the next region down by at least
+ * STACK_GUARDPAGES unmapped pages, so that overflowing the stack
+ * faults instead of scribbling on the heap or data.
+ */
+#define STACK_MAXPAGES       256
+#define STACK_GUARDPAGES     1
+
+/*
+ * Stacks for threads created with __thread_create don't grow: each is
+ * a region of THREADSTACK_PAGES pages (faulted in on demand like any
+ * other), placed below the space the main stack may grow into, with
+ * STACK_GUARDPAGES unmapped pages above it.
+ */
+#define THREADSTACK_PAGES    64
+#else
+/* under dumbvm, always have 48k of user stack */
+#define DUMBVM_STACKPAGES    12
+#endif /* OPT_A3 */
+
+#if OPT_A3
+/*
+ * Coremap: one entry for every physical page between the first free
+ * address reported by ram_getsize() and the top of RAM. The coremap
+ * itself lives in the first few of those pages, which are marked in
+ * use and never released.
+ *
+ * cm_npages and cm_refcount are only set on the first page of an
+ * allocation. cm_npages tells coremap_free() how many contiguous pages
+ * to give back; cm_refcount counts the address spaces sharing a user
+ * page copy-on-write, and the pages are only released when it drops
+ * to zero.
+ *
+ * User pages record the address space and virtual address that map
+ * them in cm_as/cm_vaddr once vm_fault has entered them into the TLB.
+ * Only such pages, and only while they are not shared, are candidates
+ * for eviction. cm_referenced is the second-chance bit for the clock
+ * algorithm; since the MIPS TLB has no hardware referenced bit it is
+ * set whenever the page is loaded into the TLB. cm_busy is set while
+ * the page is being written to swap; anyone who wants to use or
+ * change the mapping in the meantime waits on coremap_wchan.
+ *
+ * Pages of read-only file-backed regions are also entered in the page
+ * cache under cm_vnode and cm_fileoff (see below).
+ *
+ * Page table entries for user pages (see pt_lookup) are only changed
+ * with coremap_lock held, so that the evictor sees a consistent
+ * mapping.
+ */
+struct coremap_entry {
+	bool cm_used;			/* page is allocated */
+	unsigned cm_npages;		/* length of allocation starting here */
+	unsigned cm_refcount;		/* references to this allocation */
+	struct addrspace *cm_as;	/* owner of an evictable user page */
+	vaddr_t cm_vaddr;		/* where cm_as maps it */
+	bool cm_referenced;		/* used since the clock hand went by */
+	bool cm_busy;			/* being paged out */
+	bool cm_writable;		/* cm_as may write it (if private) */
+	struct vnode *cm_vnode;		/* file, if in the page cache */
+	off_t cm_fileoff;		/* offset of the page in cm_vnode */
+	unsigned cm_hashnext;		/* next page in page cache chain */
+};
+
+static struct coremap_entry *coremap;
+static paddr_t coremap_base;		/* physical address of coremap[0] */
+static unsigned coremap_npages;		/* number of pages tracked */
+static unsigned coremap_nused;		/* number of pages allocated */
+static unsigned coremap_hint;		/* where the next search starts */
+static unsigned coremap_clockhand;	/* next eviction candidate */
+static bool coremap_ready = false;	/* set once vm_bootstrap has run */
+static struct wchan *coremap_wchan;	/* waiters for busy pages */
+
+/*
+ * Page cache: the resident pages of read-only file-backed regions
+ * (program text, mostly), hashed by vnode and file offset so that all
+ * the address spaces that map the same part of the same file share
+ * one copy. Each bucket holds the coremap index of the first page in
+ * its chain, which is linked through cm_hashnext and ended by
+ * coremap_npages. A page leaves the cache when it is freed; the
+ * regions that map it hold a reference to the vnode until then.
+ */
+#define PAGECACHE_NBUCKETS 64
+static unsigned pagecache[PAGECACHE_NBUCKETS];
+
+/*
+ * Protects the coremap and user page tables, and wraps ram_stealmem
+ * before the coremap exists.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+#else
+/*
+ * Wrap rma_stealmem in a spinlock.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+#endif /* OPT_A3 */
+
+#if OPT_A3
+void
+vm_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned i, cmpages;
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo;
+	coremap_npages = (hi - lo) / PAGE_SIZE;
+
+	cmpages = (coremap_npages * sizeof(struct coremap_entry)
+		   + PAGE_SIZE - 1) / PAGE_SIZE;
+	KASSERT(cmpages < coremap_npages);
+
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cm_used = i < cmpages;
+		coremap[i].cm_npages = 0;
+		coremap[i].cm_refcount = 0;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_vaddr = 0;
+		coremap[i].cm_referenced = false;
+		coremap[i].cm_busy = false;
+		coremap[i].cm_writable = false;
+		coremap[i].cm_vnode = NULL;
+		coremap[i].cm_fileoff = 0;
+		coremap[i].cm_hashnext = coremap_npages;
+	}
+	coremap[0].cm_npages = cmpages;
+	for (i=0; i<PAGECACHE_NBUCKETS; i++) {
+		pagecache[i] = coremap_npages;
+	}
+	coremap[0].cm_refcount = 1;
+
+	spinlock_acquire(&coremap_lock);
+	coremap_nused = cmpages;
+	coremap_hint = cmpages;
+	coremap_clockhand = cmpages;
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	coremap_wchan = wchan_create("coremap");
+	if (coremap_wchan == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	vmstats_init();
+	swap_bootstrap();
+}
+
+/*
+ * Find NPAGES free contiguous pages with indexes in [from, to).
+ * Returns the index of the first one, or coremap_npages if there
+ * is no such run.
+ */
+static
+unsigned
+coremap_findrun(unsigned from, unsigned to, unsigned long npages)
+{
+	unsigned i, run;
+
+	run = 0;
+	for (i=from; i<to; i++) {
+		if (coremap[i].cm_used) {
+			run = 0;
+			continue;
+		}
+		if (++run == npages) {
+			return i + 1 - npages;
+		}
+	}
+	return coremap_npages;
+}
+
+/*
+ * Allocate NPAGES contiguous physical pages. Uses next-fit starting
+ * from the end of the last allocation, so that a run of single-page
+ * allocations doesn't keep rescanning the busy low end of memory.
+ */
+static
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned start, limit, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages == 0 || npages > coremap_npages - coremap_nused) {
+		return 0;
+	}
+
+	start = coremap_findrun(coremap_hint, coremap_npages, npages);
+	if (start == coremap_npages) {
+		/* wrap around; the run may end just past the old hint */
+		limit = coremap_hint + npages - 1;
+		if (limit > coremap_npages) {
+			limit = coremap_npages;
+		}
+		start = coremap_findrun(0, limit, npages);
+		if (start == coremap_npages) {
+			return 0;
+		}
+	}
+
+	for (i=start; i<start+npages; i++) {
+		KASSERT(!coremap[i].cm_used);
+		coremap[i].cm_used = true;
+		coremap[i].cm_npages = 0;
+	}
+	coremap[start].cm_npages = npages;
+	coremap[start].cm_refcount = 1;
+
+	coremap_nused += npages;
+	coremap_hint = (start + npages) % coremap_npages;
+
+	return coremap_base + start * PAGE_SIZE;
+}
+
+/*
+ * Return the coremap index of the allocation that starts at PADDR.
+ */
+static
+unsigned
+coremap_index(paddr_t paddr)
+{
+	unsigned index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(paddr >= coremap_base);
+
+	index = (paddr - coremap_base) / PAGE_SIZE;
+	KASSERT(index < coremap_npages);
+
+	if (!coremap[index].cm_used || coremap[index].cm_npages == 0) {
+		panic("coremap: bad allocation address 0x%x\n", paddr);
+	}
+	return index;
+}
+
+static
+unsigned
+pagecache_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		% PAGECACHE_NBUCKETS;
+}
+
+/*
+ * Return the cached page holding OFFSET in V, or 0 if there is none.
+ */
+static
+paddr_t
+pagecache_find(struct vnode *v, off_t offset)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (i = pagecache[pagecache_hash(v, offset)]; i != coremap_npages;
+	     i = coremap[i].cm_hashnext) {
+		if (coremap[i].cm_vnode == v &&
+		    coremap[i].cm_fileoff == offset) {
+			return coremap_base + i * PAGE_SIZE;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Enter the user page PADDR in the page cache as OFFSET in V.
+ */
+static
+void
+pagecache_add(paddr_t paddr, struct vnode *v, off_t offset)
+{
+	unsigned index, bucket;
+
+	index = coremap_index(paddr);
+	KASSERT(coremap[index].cm_vnode == NULL);
+
+	bucket = pagecache_hash(v, offset);
+	coremap[index].cm_vnode = v;
+	coremap[index].cm_fileoff = offset;
+	coremap[index].cm_hashnext = pagecache[bucket];
+	pagecache[bucket] = index;
+}
+
+/*
+ * Take the page with coremap index INDEX out of the page cache.
+ */
+static
+void
+pagecache_remove(unsigned index)
+{
+	unsigned *prev;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[index].cm_vnode != NULL);
+
+	prev = &pagecache[pagecache_hash(coremap[index].cm_vnode,
+					 coremap[index].cm_fileoff)];
+	while (*prev != index) {
+		KASSERT(*prev != coremap_npages);
+		prev = &coremap[*prev].cm_hashnext;
+	}
+	*prev = coremap[index].cm_hashnext;
+
+	coremap[index].cm_vnode = NULL;
+	coremap[index].cm_fileoff = 0;
+	coremap[index].cm_hashnext = coremap_npages;
+}
+
+/*
+ * Drop a reference to the allocation that starts at PADDR, and
+ * release it if that was the last one.
+ */
+static
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned index, npages, i;
+
+	index = coremap_index(paddr);
+
+	KASSERT(coremap[index].cm_refcount > 0);
+	coremap[index].cm_refcount--;
+	if (coremap[index].cm_refcount > 0) {
+		return;
+	}
+
+	if (coremap[index].cm_vnode != NULL) {
+		pagecache_remove(index);
+	}
+
+	npages = coremap[index].cm_npages;
+	KASSERT(index + npages <= coremap_npages);
+
+	for (i=index; i<index+npages; i++) {
+		KASSERT(coremap[i].cm_used);
+		KASSERT(!coremap[i].cm_busy);
+		coremap[i].cm_used = false;
+		coremap[i].cm_npages = 0;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_referenced = false;
+		coremap[i].cm_writable = false;
+	}
+
+	KASSERT(coremap_nused >= npages);
+	coremap_nused -= npages;
+}
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap_ready) {
+		addr = coremap_alloc(npages);
+	}
+	else {
+		addr = ram_stealmem(npages);
+	}
+
+	spinlock_release(&coremap_lock);
+	return addr;
+}
+
+static
+void
+freeppages(paddr_t addr)
+{
+	spinlock_acquire(&coremap_lock);
+
+	/*
+	 * Pages stolen before vm_bootstrap are below the coremap and
+	 * were never tracked; there is nothing to give them back to.
+	 */
+	if (coremap_ready && addr >= coremap_base) {
+		coremap_free(addr);
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Drop address space AS's reference to the user page at PADDR. If AS
+ * was recorded as the page's owner, forget that, since its mapping
+ * is going away.
+ */
+static
+void
+page_drop(paddr_t paddr, struct addrspace *as)
+{
+	unsigned index;
+
+	index = coremap_index(paddr);
+	KASSERT(!coremap[index].cm_busy);
+	if (coremap[index].cm_as == as) {
+		coremap[index].cm_as = NULL;
+	}
+	coremap_free(paddr);
+}
+
+/*
+ * Wait until the page at PADDR is no longer being paged out. Called
+ * with coremap_lock held; returns with it released, since the
+ * mapping the caller looked at has probably changed.
+ */
+static
+void
+page_wait(paddr_t paddr)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[coremap_index(paddr)].cm_busy);
+
+	wchan_lock(coremap_wchan);
+	spinlock_release(&coremap_lock);
+	wchan_sleep(coremap_wchan);
+}
+
+void
+coremap_getstats(unsigned *nused, unsigned *nfree)
+{
+	spinlock_acquire(&coremap_lock);
+	*nused = coremap_nused;
+	*nfree = coremap_npages - coremap_nused;
+	spinlock_release(&coremap_lock);
+}
+#else
+void
+vm_bootstrap(void)
+{
+	/* Do nothing. */
+}
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+#endif /* OPT_A3 */
+
+#if OPT_A3
+static paddr_t getkpages(unsigned long npages);
+#endif /* OPT_A3 */
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+#if OPT_A3
+	pa = getkpages(npages);
+#else
+	pa = getppages(npages);
+#endif /* OPT_A3 */
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+#if OPT_A3
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	freeppages(addr - MIPS_KSEG0);
+#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+#endif /* OPT_A3 */
+}
+
+#if !OPT_A3
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+#endif /* !OPT_A3 */
+
+#if OPT_A3
+/*
+ * Return the region of AS that contains VADDR, or NULL if there is
+ * none.
+ */
+static
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return the first region of AS that overlaps the NPAGES pages
+ * starting at VBASE, or NULL if there is none.
+ */
+static
+struct region *
+as_findoverlap(struct addrspace *as, vaddr_t vbase, size_t npages)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vbase < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+		    rg->rg_vbase < vbase + npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make a zero-filled region, not yet in any address space.
+ */
+static
+struct region *
+region_create(vaddr_t vbase, size_t npages,
+	      bool readable, bool writeable, bool executable)
+{
+	struct region *rg;
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return NULL;
+	}
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_readable = readable;
+	rg->rg_writeable = writeable;
+	rg->rg_executable = executable;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_filevaddr = 0;
+	rg->rg_filesz = 0;
+	rg->rg_next = NULL;
+	return rg;
+}
+
+/*
+ * Add a region of NPAGES pages starting at VBASE to AS. It must lie
+ * in user space and not overlap any region already there.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vbase, size_t npages,
+	     bool readable, bool writeable, bool executable,
+	     struct region **ret)
+{
+	struct region *rg;
+
+	KASSERT((vbase & PAGE_FRAME) == vbase);
+	KASSERT(npages > 0);
+
+	if (vbase >= USERSPACETOP ||
+	    npages > (USERSPACETOP - vbase) / PAGE_SIZE) {
+		return EFAULT;
+	}
+	if (as_findoverlap(as, vbase, npages) != NULL) {
+		return EFAULT;
+	}
+
+	rg = region_create(vbase, npages, readable, writeable, executable);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+/*
+ * Extend the stack of AS down to VADDR if that is allowed, and return
+ * the stack region, or NULL if VADDR is not a valid stack address.
+ */
+static
+struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack;
+
+	stack = as->as_stack;
+	if (stack == NULL || vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - STACK_MAXPAGES * PAGE_SIZE) {
+		return NULL;
+	}
+
+	/* Nothing may lie in the new part, or in the guard below it */
+	if (as_findoverlap(as, vaddr - STACK_GUARDPAGES * PAGE_SIZE,
+			   (stack->rg_vbase - vaddr) / PAGE_SIZE
+			   + STACK_GUARDPAGES) != NULL) {
+		return NULL;
+	}
+
+	stack->rg_npages += (stack->rg_vbase - vaddr) / PAGE_SIZE;
+	stack->rg_vbase = vaddr;
+	return stack;
+}
+
+/*
+ * Return the page table entry for VADDR in AS. If the second-level
+ * table for it doesn't exist yet, create it if CREATE is set, and
+ * otherwise return NULL. Also returns NULL if we run out of memory.
+ *
+ * Second-level tables are installed with coremap_lock held and are
+ * not freed until the address space is destroyed, so the entry does
+ * not move once it has been found.
+ */
+static
+paddr_t *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	paddr_t *table, *newtable;
+	unsigned i;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	table = as->as_pt[PT_L1INDEX(vaddr)];
+	if (table == NULL && create) {
+		newtable = kmalloc(PT_L2SIZE * sizeof(paddr_t));
+		if (newtable == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_L2SIZE; i++) {
+			newtable[i] = 0;
+		}
+
+		spinlock_acquire(&coremap_lock);
+		table = as->as_pt[PT_L1INDEX(vaddr)];
+		if (table == NULL) {
+			table = newtable;
+			as->as_pt[PT_L1INDEX(vaddr)] = table;
+			newtable = NULL;
+		}
+		spinlock_release(&coremap_lock);
+
+		if (newtable != NULL) {
+			kfree(newtable);
+		}
+	}
+	if (table == NULL) {
+		return NULL;
+	}
+	return &table[PT_L2INDEX(vaddr)];
+}
+
+/*
+ * Release the page (or swap slot) behind the page table entry PTE
+ * in address space AS, waiting for it first if it is being paged out.
+ */
+static
+void
+pte_release(struct addrspace *as, paddr_t *pte)
+{
+	paddr_t entry;
+
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		entry = *pte;
+		if (entry == 0 || (entry & PTE_SWAPPED)) {
+			break;
+		}
+		if (!coremap[coremap_index(entry)].cm_busy) {
+			page_drop(entry, as);
+			*pte = 0;
+			spinlock_release(&coremap_lock);
+			return;
+		}
+		page_wait(entry);
+	}
+	*pte = 0;
+	spinlock_release(&coremap_lock);
+
+	if (entry & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(entry));
+	}
+}
+
+/*
+ * Fill the freshly allocated page PADDR with the contents of the page
+ * at VADDR in RG: whatever part of it overlaps the file image is read
+ * from the executable and the rest is zeroed.
+ */
+static
+int
+region_loadpage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end, filetop;
+	char *kpage;
+	int result;
+
+	kpage = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kpage, PAGE_SIZE);
+
+	filetop = rg->rg_filevaddr + rg->rg_filesz;
+	start = vaddr > rg->rg_filevaddr ? vaddr : rg->rg_filevaddr;
+	end = vaddr + PAGE_SIZE < filetop ? vaddr + PAGE_SIZE : filetop;
+
+	if (rg->rg_vnode == NULL || start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
+	      (unsigned long) (end - start), (unsigned long) start);
+
+	uio_kinit(&iov, &ku, kpage + (start - vaddr), end - start,
+		  rg->rg_offset + (start - rg->rg_filevaddr), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+/*
+ * Address space IDs. Each TLB entry is tagged with the ASID of the
+ * address space it belongs to, so entries for several processes can
+ * stay in the TLB at once and a context switch doesn't need a flush.
+ *
+ * ASIDs are handed out in order from a global pool; ASID 0 is never
+ * used. When the pool runs out we start a new generation: from then
+ * on every address space gets a new ASID before it runs again, and
+ * each CPU flushes its TLB the first time it loads an ASID from the
+ * new generation. An ASID is never reused within a generation, so
+ * dropping an address space's ASID (setting as_asidgen to 0) orphans
+ * all its TLB entries, on every CPU, without touching the TLB.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;
+static unsigned asid_next = 1;
+
+/*
+ * Invalidate every entry in this CPU's TLB.
+ */
+static
+void
+tlb_invalidate_all(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(curcpu->c_tlb_asid);
+	curcpu->c_tlb_nused = 0;
+	curcpu->c_tlb_victim = 0;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+/*
+ * Make AS's ASID the current one on this CPU, giving it a new one
+ * first if it has none in the current generation.
+ */
+static
+void
+asid_activate(struct addrspace *as)
+{
+	unsigned asid, gen;
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_TLBPID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		/*
+		 * Don't clear as_cpus: another thread of this address
+		 * space may still be running elsewhere under the old
+		 * ASID, and must keep getting shootdowns until it moves
+		 * to the new one (see vm_tlbshootdown).
+		 */
+	}
+	KASSERT(curcpu->c_number < 32);
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	asid = as->as_asid;
+	gen = as->as_asidgen;
+	spinlock_release(&asid_lock);
+
+	curcpu->c_tlb_asid = asid;
+	if (curcpu->c_tlb_asidgen != gen) {
+		/* The TLB may hold old entries under the same ASID */
+		curcpu->c_tlb_asidgen = gen;
+		tlb_invalidate_all();
+	}
+	tlb_setpid(asid);
+
+	splx(spl);
+}
+
+/*
+ * Fill in TS to shoot down VADDR in address space AS, and add the
+ * CPUs whose TLBs may hold it to *CPUS. Those are the ones that have
+ * loaded one of AS's ASIDs. Entries under an ASID it has since given
+ * up are unreachable, except on a CPU still running AS under that
+ * ASID, which vm_tlbshootdown moves to the current one.
+ */
+static
+void
+tlb_mapping(struct addrspace *as, vaddr_t vaddr, struct tlbshootdown *ts,
+	    uint32_t *cpus)
+{
+	spinlock_acquire(&asid_lock);
+	ts->ts_as = as;
+	ts->ts_asid = as->as_asid;
+	ts->ts_asidgen = as->as_asidgen;
+	ts->ts_vaddr = vaddr;
+	*cpus |= as->as_cpus;
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Invalidate the N mappings in TS on the CPUs in CPUS, this one
+ * included, and wait until it has been done everywhere. Each other
+ * CPU gets all N in one IPI.
+ */
+static
+void
+tlb_shootdown(const struct tlbshootdown *ts, unsigned n, uint32_t cpus)
+{
+	unsigned sent;
+
+	sent = ipi_tlbshootdown_batch(cpus, ts, n);
+	while (sent-- > 0) {
+		vmstats_inc(VMSTAT_TLB_SHOOTDOWN_IPI);
+	}
+}
+
+/*
+ * Remove any TLB entry for VADDR in address space AS, on every CPU.
+ */
+static
+void
+tlb_unmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	uint32_t cpus;
+
+	cpus = 0;
+	tlb_mapping(as, vaddr, &ts, &cpus);
+	tlb_shootdown(&ts, 1, cpus);
+}
+
+/*
+ * Too many shootdowns piled up; flush everything. One of the ones
+ * we lost track of may have been an ASID retirement (see below), so
+ * also pick up the current address space's ASID afresh.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	tlb_invalidate_all();
+	as_activate();
+}
+
+/*
+ * The entry can only be in this CPU's TLB if the ASID is from the
+ * generation the TLB holds.
+ *
+ * A TLBSHOOTDOWN_RETIRE shootdown means the address space has given
+ * up its ASID. That orphans its entries everywhere, except on a CPU
+ * that still has the ASID loaded because it is running another
+ * thread of the same process; that CPU switches to the address
+ * space's new ASID.
+ *
+ * A CPU can also be running a thread of the address space under an
+ * ASID from an older generation, if another thread of it was given a
+ * fresh ASID elsewhere after the generation rolled over. Its entries
+ * are still live, but no shootdown would ever match them; so such a
+ * CPU moves to the current ASID first, which flushes its TLB.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	if ((ts->ts_asidgen != curcpu->c_tlb_asidgen ||
+	     ts->ts_asid != curcpu->c_tlb_asid) &&
+	    ts->ts_as == curproc_getas()) {
+		as_activate();
+	}
+
+	if (ts->ts_asidgen == curcpu->c_tlb_asidgen &&
+	    ts->ts_vaddr == TLBSHOOTDOWN_RETIRE) {
+		if (ts->ts_asid == curcpu->c_tlb_asid) {
+			as_activate();
+		}
+	}
+	else if (ts->ts_asidgen == curcpu->c_tlb_asidgen) {
+		i = tlb_probe(ts->ts_vaddr | (ts->ts_asid << TLBHI_PIDSHIFT),
+			      0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			vmstats_inc(VMSTAT_TLB_SHOOTDOWN_INVAL);
+		}
+		tlb_setpid(curcpu->c_tlb_asid);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Choose a page to evict with the clock algorithm: sweep round the
+ * coremap clearing referenced bits, and take the first evictable page
+ * that hasn't been used since the last sweep. Returns coremap_npages
+ * if nothing can be evicted.
+ */
+static
+unsigned
+coremap_clock(void)
+{
+	struct coremap_entry *e;
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	/* Two full turns: the first may only clear referenced bits. */
+	for (n=0; n<2*coremap_npages; n++) {
+		i = coremap_clockhand;
+		coremap_clockhand = (coremap_clockhand + 1) % coremap_npages;
+
+		e = &coremap[i];
+		if (!e->cm_used || e->cm_as == NULL || e->cm_busy ||
+		    e->cm_refcount != 1) {
+			continue;
+		}
+		KASSERT(e->cm_npages == 1);
+		if (e->cm_referenced) {
+			e->cm_referenced = false;
+			continue;
+		}
+		return i;
+	}
+	return coremap_npages;
+}
+
+/*
+ * Page out up to EVICT_BATCH user pages to make room. Pages in the
+ * page cache are never written, so they are just dropped and read
+ * back in from the file if needed again; everything else goes to
+ * swap. Taking several pages at a time lets one round of TLB
+ * shootdowns cover all of them.
+ */
+#define EVICT_BATCH 4
+
+static
+int
+vm_evict(void)
+{
+	struct {
+		struct addrspace *as;
+		paddr_t paddr;
+		paddr_t *pte;
+		unsigned slot;
+		bool clean;
+		int result;
+	} v[EVICT_BATCH];
+	struct tlbshootdown ts[EVICT_BATCH];
+	struct coremap_entry *e;
+	uint32_t cpus;
+	unsigned index, n, i;
+	int result;
+
+	cpus = 0;
+	result = ENOMEM;
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<EVICT_BATCH; n++) {
+		index = coremap_clock();
+		if (index == coremap_npages) {
+			break;
+		}
+
+		e = &coremap[index];
+		v[n].as = e->cm_as;
+		v[n].paddr = coremap_base + index * PAGE_SIZE;
+
+		/*
+		 * The owner cannot free its page tables while we have a
+		 * busy page in them (pte_release waits), so PTE stays
+		 * valid.
+		 */
+		v[n].pte = pt_lookup(e->cm_as, e->cm_vaddr, false);
+		KASSERT(v[n].pte != NULL && *v[n].pte == v[n].paddr);
+
+		v[n].clean = e->cm_vnode != NULL;
+		v[n].slot = 0;
+		if (!v[n].clean) {
+			result = swap_alloc(&v[n].slot);
+			if (result) {
+				break;
+			}
+		}
+
+		e->cm_busy = true;
+		tlb_mapping(e->cm_as, e->cm_vaddr, &ts[n], &cpus);
+	}
+	spinlock_release(&coremap_lock);
+
+	if (n == 0) {
+		return result;
+	}
+
+	/* Nobody can load these mappings again while they are busy. */
+	tlb_shootdown(ts, n, cpus);
+
+	for (i=0; i<n; i++) {
+		v[i].result = v[i].clean ? 0 : swap_write(v[i].slot,
+							   v[i].paddr);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<n; i++) {
+		KASSERT(*v[i].pte == v[i].paddr);
+		coremap[coremap_index(v[i].paddr)].cm_busy = false;
+		if (v[i].result == 0) {
+			*v[i].pte = v[i].clean ? 0 : PTE_MKSWAP(v[i].slot);
+			page_drop(v[i].paddr, v[i].as);
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	wchan_wakeall(coremap_wchan);
+
+	/* Succeed if we freed anything at all. */
+	result = v[0].result;
+	for (i=0; i<n; i++) {
+		if (v[i].result) {
+			swap_free(v[i].slot);
+		}
+		else {
+			result = 0;
+		}
+	}
+	return result;
+}
+
+/*
+ * Exiting processes leave their address spaces to the work queues to
+ * destroy, so memory may be about to come free. Wait for any pending
+ * teardowns before running out. Returns true if we waited; false if
+ * we can't, because we are a worker ourselves.
+ */
+static
+bool
+vm_reclaim(void)
+{
+	if (!workqueue_flush()) {
+		return false;
+	}
+	kmalloc_trim();
+	return true;
+}
+
+/*
+ * Allocate a page for user memory, evicting someone else's if
+ * physical memory is full.
+ */
+static
+paddr_t
+getuserpage(void)
+{
+	paddr_t paddr;
+
+	while ((paddr = getppages(1)) == 0) {
+		if (vm_evict()) {
+			/* Last try: see vm_reclaim */
+			if (vm_reclaim()) {
+				paddr = getppages(1);
+			}
+			return paddr;
+		}
+	}
+	return paddr;
+}
+
+/*
+ * Allocate pages for the kernel. If memory is full, page out user
+ * pages to make room, but only if we are somewhere that can sleep
+ * (kmalloc is called from interrupt handlers and with spinlocks
+ * held). Evicting single pages may never produce a large enough
+ * contiguous run, so give up after a while.
+ */
+static
+paddr_t
+getkpages(unsigned long npages)
+{
+	paddr_t paddr;
+	unsigned long tries;
+
+	paddr = getppages(npages);
+	if (paddr == 0) {
+		/*
+		 * Blocks cached by kmalloc may be pinning free pages.
+		 * This only gets back this cpu's. The other cpus empty
+		 * their caches on their next kmalloc or kfree, and an
+		 * idle cpu (whose hardclock is stopped) may not make
+		 * one for a long time, so don't count on their blocks
+		 * here; the eviction below is what we rely on.
+		 */
+		kmalloc_trim();
+		paddr = getppages(npages);
+	}
+	for (tries = 0; paddr == 0 && tries < 4 * npages; tries++) {
+		if (!coremap_ready || curthread->t_in_interrupt ||
+		    curthread->t_iplhigh_count > 0) {
+			break;
+		}
+		if (vm_evict()) {
+			break;
+		}
+		paddr = getppages(npages);
+	}
+	if (paddr == 0 && coremap_ready && !curthread->t_in_interrupt &&
+	    curthread->t_iplhigh_count == 0 && vm_reclaim()) {
+		paddr = getppages(npages);
+	}
+	return paddr;
+}
+
+/*
+ * Load VADDR -> PADDR into this CPU's TLB.
+ *
+ * If there's already an entry for VADDR it is rewritten in place.
+ * That's the case on a read-only fault (MISS clear), but can also
+ * happen after a miss: another thread of the process may have loaded
+ * the page on this CPU while we slept in vm_fault, and two matching
+ * entries in the TLB are fatal. Otherwise we use the next slot that
+ * has been empty since the last flush if there is one, and replace
+ * entries round-robin if not.
+ */
+static
+void
+tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable, bool miss)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	elo = paddr | TLBLO_VALID;
+	if (writable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	ehi = vaddr | (curcpu->c_tlb_asid << TLBHI_PIDSHIFT);
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	if (curcpu->c_tlb_nused < NUM_TLB) {
+		i = curcpu->c_tlb_nused++;
+		if (miss) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+	}
+	else {
+		i = curcpu->c_tlb_victim;
+		curcpu->c_tlb_victim = (i + 1) % NUM_TLB;
+		if (miss) {
+			vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		}
+	}
+	tlb_write(ehi, elo, i);
+
+	splx(spl);
+}
+
+/*
+ * Handle a fault of type FAULTTYPE on VADDR, in region RG of address
+ * space AS, whose page table entry is PTE: make the page resident,
+ * make it private if the fault is a write, and load it into the TLB.
+ *
+ * Each time round the loop we look at the page table entry with the
+ * coremap lock held. If the page isn't resident, or needs to be
+ * copied, we drop the lock to do that (which may sleep), install the
+ * result, and go round again.
+ *
+ * Pages of read-only file-backed regions are looked up in the page
+ * cache before being read in, and entered in it afterwards.
+ *
+ * RG is a copy of the region, taken under as_lock when as_unmapseq
+ * was UNMAPSEQ. If that has changed since, a region may have been
+ * removed from under us, so we load and install nothing and return 0;
+ * the access is retried and faults again, and the region is looked
+ * up afresh.
+ */
+static
+int
+region_fault(struct addrspace *as, struct region *rg, paddr_t *pte,
+	     vaddr_t vaddr, int faulttype, unsigned unmapseq)
+{
+	struct coremap_entry *e;
+	paddr_t entry, newpage;
+	bool write, miss, loaded, cached;
+	off_t fileoff;
+	int result;
+
+	write = faulttype != VM_FAULT_READ;
+	miss = faulttype != VM_FAULT_READONLY;
+	loaded = false;
+
+	cached = rg->rg_vnode != NULL && !rg->rg_writeable;
+	fileoff = rg->rg_offset + ((off_t)vaddr - (off_t)rg->rg_filevaddr);
+
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		if (as->as_unmapseq != unmapseq) {
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+		entry = *pte;
+
+		if (entry == 0 && cached) {
+			entry = pagecache_find(rg->rg_vnode, fileoff);
+			if (entry != 0 &&
+			    !coremap[coremap_index(entry)].cm_busy) {
+				/* Share the copy another process read in. */
+				coremap[coremap_index(entry)].cm_refcount++;
+				*pte = entry;
+			}
+		}
+
+		if (entry != 0 && (entry & PTE_SWAPPED) == 0) {
+			e = &coremap[coremap_index(entry)];
+			if (e->cm_busy) {
+				page_wait(entry);
+				continue;
+			}
+			if (e->cm_refcount == 1 || !write) {
+				if (miss && !loaded) {
+					/* Already resident: just a TLB refill. */
+					vmstats_inc(VMSTAT_TLB_RELOAD);
+				}
+				if (e->cm_refcount == 1) {
+					/* We are the only user; we own it now. */
+					e->cm_as = as;
+					e->cm_vaddr = vaddr;
+					e->cm_referenced = true;
+					e->cm_writable = rg->rg_writeable;
+				}
+				/* Shared pages are read-only until written. */
+				tlb_load(vaddr, entry,
+					 e->cm_refcount == 1 && rg->rg_writeable,
+					 miss);
+				spinlock_release(&coremap_lock);
+				return 0;
+			}
+			/* Copy-on-write: make our own copy below. */
+		}
+		spinlock_release(&coremap_lock);
+
+		newpage = getuserpage();
+		if (newpage == 0) {
+			return ENOMEM;
+		}
+
+		if (entry == 0) {
+			result = region_loadpage(rg, vaddr, newpage);
+			loaded = true;
+		}
+		else if (entry & PTE_SWAPPED) {
+			result = swap_read(PTE_SLOT(entry), newpage);
+			if (result == 0) {
+				vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			}
+			loaded = true;
+		}
+		else {
+			memmove((void *)PADDR_TO_KVADDR(newpage),
+				(const void *)PADDR_TO_KVADDR(entry),
+				PAGE_SIZE);
+			result = 0;
+		}
+		if (result) {
+			freeppages(newpage);
+			return result;
+		}
+
+		spinlock_acquire(&coremap_lock);
+		if (as->as_unmapseq != unmapseq) {
+			spinlock_release(&coremap_lock);
+			freeppages(newpage);
+			return 0;
+		}
+		if (*pte != entry || (entry != 0 && (entry & PTE_SWAPPED) == 0
+				      && coremap[coremap_index(entry)].cm_busy)) {
+			/*
+			 * The shared page we copied is being (or has been)
+			 * paged out, because its other users went away
+			 * while we were copying. Start over.
+			 */
+			spinlock_release(&coremap_lock);
+			freeppages(newpage);
+			continue;
+		}
+		if (entry == 0 && cached) {
+			if (pagecache_find(rg->rg_vnode, fileoff) != 0) {
+				/* Someone beat us to it; use theirs. */
+				spinlock_release(&coremap_lock);
+				freeppages(newpage);
+				continue;
+			}
+			pagecache_add(newpage, rg->rg_vnode, fileoff);
+		}
+		*pte = newpage;
+		if (entry != 0 && (entry & PTE_SWAPPED) == 0) {
+			/*
+			 * Other CPUs may still have our read-only mapping
+			 * of the page we copied; get rid of it before we
+			 * let go of the page. Nobody will pick it to page
+			 * out meanwhile once it has no owner.
+			 */
+			e = &coremap[coremap_index(entry)];
+			if (e->cm_as == as) {
+				e->cm_as = NULL;
+			}
+			spinlock_release(&coremap_lock);
+			tlb_unmap(as, vaddr);
+			spinlock_acquire(&coremap_lock);
+			page_drop(entry, as);
+		}
+		spinlock_release(&coremap_lock);
+
+		if (entry & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(entry));
+		}
+	}
+}
+
+/*
+ * Handle a TLB miss on VADDR in AS from the page table alone, if the
+ * page is resident and nothing more than a TLB refill is needed.
+ * Returns false if the fault needs the full treatment: the page isn't
+ * resident, is being paged out or needs copying on this write, or a
+ * region is being removed (see as_destroy_threadstack).
+ *
+ * A private page is loaded writable if the last full fault on it
+ * found it in a writable region (cm_writable); a shared one is always
+ * read-only. This needs neither as_lock nor the region.
+ */
+static
+bool
+tlb_refill(struct addrspace *as, vaddr_t vaddr, bool write)
+{
+	struct coremap_entry *e;
+	paddr_t *pte, entry;
+
+	pte = pt_lookup(as, vaddr, false);
+	if (pte == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	entry = *pte;
+	if (as->as_unmapseq % 2 != 0 || entry == 0 ||
+	    (entry & PTE_SWAPPED) != 0) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	e = &coremap[coremap_index(entry)];
+	if (e->cm_busy || (write && (e->cm_refcount > 1 || !e->cm_writable))) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+
+	if (e->cm_refcount == 1) {
+		e->cm_as = as;
+		e->cm_vaddr = vaddr;
+		e->cm_referenced = true;
+	}
+	tlb_load(vaddr, entry, e->cm_refcount == 1 && e->cm_writable, true);
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct region *rg, region;
+	struct addrspace *as;
+	unsigned unmapseq;
+	paddr_t *pte;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/* Write to a page still shared copy-on-write */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
 
-/*
- * Wrap rma_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
 
-void
-vm_bootstrap(void)
-{
-	/* Do nothing. */
-}
+	if (faulttype != VM_FAULT_READONLY &&
+	    tlb_refill(as, faultaddress, faulttype == VM_FAULT_WRITE)) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+		return 0;
+	}
 
-static
-paddr_t
-getppages(unsigned long npages)
-{
-	paddr_t addr;
+	/*
+	 * Other threads may be adding or removing thread stacks, or
+	 * growing the stack, so work from a copy of the region. Only
+	 * the copy's file backing and permissions are used, and they
+	 * don't change; region_fault uses as_unmapseq to notice if the
+	 * region itself goes away.
+	 */
+	lock_acquire(as->as_lock);
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_growstack(as, faultaddress);
+	}
+	if (rg != NULL) {
+		region = *rg;
+	}
+	unmapseq = as->as_unmapseq;
+	lock_release(as->as_lock);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READ && !region.rg_writeable) {
+		/* Write to a read-only region */
+		return EFAULT;
+	}
 
-	spinlock_acquire(&stealmem_lock);
+	pte = pt_lookup(as, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
 
-	addr = ram_stealmem(npages);
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
 
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return region_fault(as, &region, pte, faultaddress, faulttype,
+			    unmapseq);
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(int npages)
+struct addrspace *
+as_create(void)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	struct addrspace *as;
+	unsigned i;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
 	}
-	return PADDR_TO_KVADDR(pa);
-}
 
-void
-free_kpages(vaddr_t addr)
-{
-	/* nothing - leak the memory. */
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_pt = kmalloc(PT_L1SIZE * sizeof(paddr_t *));
+	if (as->as_pt == NULL) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		as->as_pt[i] = NULL;
+	}
+	as->as_regions = NULL;
+	as->as_stack = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	as->as_unmapseq = 0;
 
-	(void)addr;
+	return as;
 }
 
+/*
+ * All the pages have to be released before any page table is freed,
+ * because the evictor may look up a page owned by AS in any of them
+ * until then.
+ */
 void
-vm_tlbshootdown_all(void)
+as_destroy(struct addrspace *as)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	struct region *rg;
+	unsigned i, j;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (as->as_pt[i] == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2SIZE; j++) {
+			if (as->as_pt[i][j] != 0) {
+				pte_release(as, &as->as_pt[i][j]);
+			}
+		}
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (as->as_pt[i] != NULL) {
+			kfree(as->as_pt[i]);
+		}
+	}
+	kfree(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
 
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+#else
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -230,11 +1788,14 @@ as_destroy(struct addrspace *as)
 {
 	kfree(as);
 }
+#endif /* OPT_A3 */
 
 void
 as_activate(void)
 {
+#if !OPT_A3
 	int i, spl;
+#endif
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -245,6 +1806,9 @@ as_activate(void)
 		return;
 	}
 
+#if OPT_A3
+	asid_activate(as);
+#else
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -253,6 +1817,7 @@ as_activate(void)
 	}
 
 	splx(spl);
+#endif /* OPT_A3 */
 }
 
 void
@@ -261,6 +1826,67 @@ as_deactivate(void)
 	/* nothing */
 }
 
+#if OPT_A3
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	size_t npages;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+	if (npages == 0) {
+		return 0;
+	}
+
+	/* Nothing is copied in up front, so the range is checked here */
+	return as_addregion(as, vaddr, npages, readable != 0,
+			    writeable != 0, executable != 0, NULL);
+}
+
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr,
+		  struct vnode *v, off_t offset, size_t filesz)
+{
+	struct region *rg;
+
+	if (filesz == 0) {
+		/* all zero-fill */
+		return 0;
+	}
+
+	rg = as_findregion(as, vaddr & PAGE_FRAME);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	if (filesz > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+		return ENOEXEC;
+	}
+
+	KASSERT(rg->rg_vnode == NULL);
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_filesz = filesz;
+
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Pages are faulted in on demand; just add the stack. */
+	return as_addregion(as, USERSTACK - PAGE_SIZE, 1, true, true, false,
+			    &as->as_stack);
+}
+#else
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -335,6 +1961,7 @@ as_prepare_load(struct addrspace *as)
 
 	return 0;
 }
+#endif /* OPT_A3 */
 
 int
 as_complete_load(struct addrspace *as)
@@ -343,18 +1970,337 @@ as_complete_load(struct addrspace *as)
 	return 0;
 }
 
+#if OPT_A2
+/*
+ * Set up the initial stack and hand back the stack pointer. The ARGC
+ * strings in ARGV are copied to the top of the stack, with the argv
+ * array (NULL-terminated) below them at the initial stack pointer,
+ * which is thus also the user address of argv. AS must be the
+ * current address space.
+ */
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr, unsigned argc, struct array *argv)
 {
+	userptr_t *uargv;
+	const char *arg;
+	vaddr_t sp;
+	size_t len;
+	unsigned i;
+	int result;
+
+#if OPT_A3
+	KASSERT(as->as_stack != NULL);
+#else
 	KASSERT(as->as_stackpbase != 0);
+#endif
+	KASSERT(as == curproc_getas());
 
-#if OPT_A2
+	uargv = kmalloc((argc + 1) * sizeof(userptr_t));
+	if (uargv == NULL) {
+		return ENOMEM;
+	}
+
+	sp = USERSTACK;
+	for (i=0; i<argc; i++) {
+		arg = array_get(argv, i);
+		len = strlen(arg) + 1;
+		sp -= len;
+		result = copyoutstr(arg, (userptr_t)sp, len, NULL);
+		if (result) {
+			kfree(uargv);
+			return result;
+		}
+		uargv[i] = (userptr_t)sp;
+	}
+	uargv[argc] = NULL;
+
+	/* 8-byte align the stack pointer, as the MIPS ABI wants */
+	sp &= ~(vaddr_t)7;
+	sp -= (argc + 1) * sizeof(userptr_t);
+	result = copyout(uargv, (userptr_t)sp, (argc + 1) * sizeof(userptr_t));
+	kfree(uargv);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = sp;
+	return 0;
+}
+#else
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+#if OPT_A3
+	KASSERT(as->as_stack != NULL);
 #else
+	KASSERT(as->as_stackpbase != 0);
+#endif
+
 	*stackptr = USERSTACK;
 	return 0;
-#endif
 }
+#endif /* OPT_A2 */
+
+#if OPT_A2
+#if OPT_A3
+/*
+ * Find room for a thread stack: the highest THREADSTACK_PAGES pages
+ * below the main stack's growth limit that are at least
+ * STACK_GUARDPAGES away from any other region, working down past
+ * whatever is in the way. Hands back the initial stack pointer, which
+ * is also the top of the region.
+ */
+int
+as_define_threadstack(struct addrspace *as, vaddr_t *stackptr)
+{
+	struct region *rg, *other;
+	vaddr_t top, base;
+
+	rg = region_create(0, THREADSTACK_PAGES, true, true, false);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+	top = USERSTACK - (STACK_MAXPAGES + STACK_GUARDPAGES) * PAGE_SIZE;
+	while (1) {
+		if (top < (THREADSTACK_PAGES + STACK_GUARDPAGES) * PAGE_SIZE) {
+			lock_release(as->as_lock);
+			kfree(rg);
+			return ENOMEM;
+		}
+		base = top - THREADSTACK_PAGES * PAGE_SIZE;
+		other = as_findoverlap(as, base - STACK_GUARDPAGES * PAGE_SIZE,
+				       THREADSTACK_PAGES + STACK_GUARDPAGES);
+		if (other == NULL) {
+			break;
+		}
+		top = other->rg_vbase - STACK_GUARDPAGES * PAGE_SIZE;
+	}
+
+	rg->rg_vbase = base;
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	lock_release(as->as_lock);
+
+	*stackptr = top;
+	return 0;
+}
+
+/*
+ * Give back the thread stack whose top is STACKTOP. Its pages are
+ * removed from every TLB, in batches, and released. We hold as_lock
+ * throughout, so the slot can't be handed out again while they are
+ * still there; and as_unmapseq is odd meanwhile, which keeps
+ * tlb_refill from loading them again and tells faults that found the
+ * region before we took it out not to install anything.
+ */
+void
+as_destroy_threadstack(struct addrspace *as, vaddr_t stacktop)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	paddr_t *ptes[TLBSHOOTDOWN_MAX];
+	struct region *rg, **rgp;
+	paddr_t *pte;
+	vaddr_t vaddr;
+	uint32_t cpus;
+	unsigned i, n;
+
+	lock_acquire(as->as_lock);
+	rg = as_findregion(as, stacktop - PAGE_SIZE);
+	KASSERT(rg != NULL);
+	KASSERT(rg->rg_vbase + rg->rg_npages * PAGE_SIZE == stacktop);
+
+	for (rgp = &as->as_regions; *rgp != rg; rgp = &(*rgp)->rg_next) {
+		KASSERT(*rgp != NULL);
+	}
+	*rgp = rg->rg_next;
+
+	spinlock_acquire(&coremap_lock);
+	as->as_unmapseq++;
+	spinlock_release(&coremap_lock);
+
+	n = 0;
+	cpus = 0;
+	for (vaddr = rg->rg_vbase; vaddr < stacktop; vaddr += PAGE_SIZE) {
+		pte = pt_lookup(as, vaddr, false);
+		if (pte != NULL && *pte != 0) {
+			tlb_mapping(as, vaddr, &ts[n], &cpus);
+			ptes[n++] = pte;
+		}
+		if (n == TLBSHOOTDOWN_MAX ||
+		    (n > 0 && vaddr + PAGE_SIZE == stacktop)) {
+			tlb_shootdown(ts, n, cpus);
+			for (i=0; i<n; i++) {
+				pte_release(as, ptes[i]);
+			}
+			n = 0;
+			cpus = 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	as->as_unmapseq++;
+	spinlock_release(&coremap_lock);
+	lock_release(as->as_lock);
+
+	kfree(rg);
+}
+#else
+int
+as_define_threadstack(struct addrspace *as, vaddr_t *stackptr)
+{
+	/* dumbvm has room for only the one stack */
+	(void)as;
+	(void)stackptr;
+	return EUNIMP;
+}
+
+void
+as_destroy_threadstack(struct addrspace *as, vaddr_t stacktop)
+{
+	(void)as;
+	(void)stacktop;
+}
+#endif /* OPT_A3 */
+#endif /* OPT_A2 */
+
+#if OPT_A3
+/*
+ * Make NEWPTE refer to the same page or swap slot as OLDPTE, sharing
+ * it copy-on-write.
+ */
+static
+void
+pte_share(paddr_t *oldpte, paddr_t *newpte)
+{
+	paddr_t entry;
+
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		entry = *oldpte;
+		if (entry == 0 || (entry & PTE_SWAPPED)) {
+			break;
+		}
+		if (!coremap[coremap_index(entry)].cm_busy) {
+			coremap[coremap_index(entry)].cm_refcount++;
+			coremap[coremap_index(entry)].cm_writable = false;
+			*newpte = entry;
+			spinlock_release(&coremap_lock);
+			return;
+		}
+		page_wait(entry);
+	}
+	*newpte = entry;
+	spinlock_release(&coremap_lock);
+
+	if (entry & PTE_SWAPPED) {
+		swap_incref(PTE_SLOT(entry));
+	}
+}
+
+/*
+ * Copy AS's page table into NEW. Resident pages are shared
+ * copy-on-write rather than copied, as are swap slots, so this only
+ * costs a walk of the page table; pages that have not been faulted
+ * in yet stay that way.
+ */
+static
+int
+pt_copy(struct addrspace *old, struct addrspace *new)
+{
+	paddr_t *newtable;
+	unsigned i, j;
+
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (old->as_pt[i] == NULL) {
+			continue;
+		}
+		newtable = pt_lookup(new, i * PT_L2SIZE * PAGE_SIZE, true);
+		if (newtable == NULL) {
+			return ENOMEM;
+		}
+		for (j=0; j<PT_L2SIZE; j++) {
+			if (old->as_pt[i][j] != 0) {
+				pte_share(&old->as_pt[i][j], &newtable[j]);
+			}
+		}
+	}
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *rg, *newrg;
+	struct tlbshootdown ts;
+	uint32_t cpus;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	/* Keep OLD's other threads from changing its regions meanwhile */
+	lock_acquire(old->as_lock);
+
+	/* The copy keeps its own references to the backing files. */
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		result = as_addregion(new, rg->rg_vbase, rg->rg_npages,
+				      rg->rg_readable, rg->rg_writeable,
+				      rg->rg_executable, &newrg);
+		if (result) {
+			lock_release(old->as_lock);
+			as_destroy(new);
+			return result;
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_offset = rg->rg_offset;
+			newrg->rg_filevaddr = rg->rg_filevaddr;
+			newrg->rg_filesz = rg->rg_filesz;
+		}
+	}
+
+	result = pt_copy(old, new);
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The pages are shared now, so any writable TLB entries for them
+	 * must go; the next write will take a READONLY fault. Dropping
+	 * OLD's ASID gets rid of all of them at once, except on CPUs
+	 * running OLD's other threads, which are told to move to the
+	 * new ASID.
+	 */
+	spinlock_acquire(&asid_lock);
+	ts.ts_as = old;
+	ts.ts_asid = old->as_asid;
+	ts.ts_asidgen = old->as_asidgen;
+	ts.ts_vaddr = TLBSHOOTDOWN_RETIRE;
+	cpus = old->as_cpus;
+	old->as_asidgen = 0;
+	spinlock_release(&asid_lock);
+	if (old == curproc_getas()) {
+		asid_activate(old);
+	}
+	if (ts.ts_asidgen != 0) {
+		tlb_shootdown(&ts, 1, cpus);
+	}
 
+	*ret = new;
+	return 0;
+}
+#else
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -395,3 +2341,4 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+#endif /* OPT_A3 */
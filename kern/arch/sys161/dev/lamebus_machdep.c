@@ -116,6 +116,24 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Stop and restart hardclock on the current CPU. The on-chip timer
+ * can't be switched off as such, so stopping it means setting the
+ * longest possible period, which at 25 MHz is nearly three minutes.
+ * If that expires, the CPU just takes one spurious hardclock.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -48,6 +48,18 @@
 
 static bool havetimerclock;
 
+/*
+ * Start the countdown timer; it will interrupt once, USECS from now.
+ */
+static
+void
+ltimer_settimer(void *vlt, uint32_t usecs)
+{
+	struct ltimer_softc *lt = vlt;
+
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -82,17 +94,15 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 
 	/*
 	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * on-chip timer can't do that. It runs one-shot: the clock
+	 * code sets it for the next timer deadline each time.
 	 */
 	if (!havetimerclock) {
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every 10 ms */
-		/* KMS: reduced this from 1s to 10ms */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		timerclock_attach(ltimer_settimer, lt);
 	}
 	
 	return 0;
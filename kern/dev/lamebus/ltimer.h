@@ -44,7 +44,7 @@ struct ltimer_softc {
 	
 };
 
-/* Granularity of countdown timer (usec) */
+/* Length of a clocknap() tick (usec) */
 /* Should be less than 1000000 */
 #define LT_GRANULARITY   10000
 
@@ -37,11 +37,13 @@
 
 #include <vm.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #if OPT_A2
 #include <array.h>
 #endif
 
 struct vnode;
+struct lock;
 
 
 /*
@@ -51,6 +53,67 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * A region is a contiguous range of virtual pages with the same
+ * permissions. Only rg_writeable is enforced: the MIPS TLB has no way
+ * to make a page unreadable or non-executable.
+ *
+ * If rg_vnode is set, the rg_filesz bytes starting at rg_filevaddr
+ * are read from that file at rg_offset when their page is faulted
+ * in. Everything else in the region is zero-filled.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  bool rg_readable;
+  bool rg_writeable;
+  bool rg_executable;
+
+  struct vnode *rg_vnode;
+  off_t rg_offset;
+  vaddr_t rg_filevaddr;
+  size_t rg_filesz;
+
+  struct region *rg_next;
+};
+
+/*
+ * Page table entries. An entry is 0 if the page has not been faulted
+ * in yet, the physical address of the page if it is resident, or a
+ * swap slot number tagged with PTE_SWAPPED if it has been paged out.
+ */
+#define PTE_SWAPPED       0x1
+#define PTE_MKSWAP(slot)  (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_SLOT(pte)     ((unsigned)((pte) >> 12))
+
+/*
+ * Two-level page table: each second-level table holds the entries for
+ * PT_L2SIZE pages (4M of address space), and the top level has one
+ * pointer per 4M of user space. Second-level tables are allocated on
+ * first touch.
+ */
+#define PT_L2SIZE          1024
+#define PT_L1SIZE          (USERSPACETOP / (PT_L2SIZE * PAGE_SIZE))
+#define PT_L1INDEX(va)     ((va) / (PT_L2SIZE * PAGE_SIZE))
+#define PT_L2INDEX(va)     (((va) / PAGE_SIZE) % PT_L2SIZE)
+
+/*
+ * as_lock protects the region list, and the regions in it, against
+ * the process's other threads. Page table entries are protected by
+ * the coremap lock instead (see dumbvm.c).
+ */
+struct addrspace {
+  struct lock *as_lock;
+  struct region *as_regions;   /* unordered list */
+  struct region *as_stack;     /* grows down on demand */
+  paddr_t **as_pt;             /* PT_L1SIZE second-level tables */
+  unsigned as_asid;            /* TLB address space ID */
+  unsigned as_asidgen;         /* generation of as_asid; 0 if none */
+  uint32_t as_cpus;            /* cpus that have loaded an ASID of ours */
+  unsigned as_unmapseq;        /* odd while a region's pages go */
+};
+#else
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -60,6 +123,7 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackpbase;
 };
+#endif /* OPT_A3 */
 
 /*
  * Functions in addrspace.c:
@@ -95,6 +159,17 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - set up a stack for another thread of the
+ *                process, and hand back its initial stack pointer.
+ *
+ *    as_destroy_threadstack - give back a stack from
+ *                as_define_threadstack, given its initial stack
+ *                pointer.
+ *
+ *    as_define_backing - record that part of an already defined
+ *                region is read from a file when it is faulted in,
+ *                rather than being loaded up front.
  */
 
 struct addrspace *as_create(void);
@@ -112,9 +187,18 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 #if OPT_A2
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr, unsigned argc, struct array *argv);
+int               as_define_threadstack(struct addrspace *as,
+                                        vaddr_t *initstackptr);
+void              as_destroy_threadstack(struct addrspace *as,
+                                         vaddr_t initstackptr);
 #else
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 #endif
+#if OPT_A3
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesz);
+#endif
 
 
 /*
@@ -35,15 +35,19 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, only when the
+ * CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU by the timer device when the
+ * earliest pending timer (see below) is due.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
  *
+ * nanotime() returns the time of day as a single count of
+ * nanoseconds, for timing short intervals. It returns 0 early in boot,
+ * before the clock device is attached.
+ *
  * XXX we have struct timespec now, let's use it.
  */
 
@@ -61,7 +65,74 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * The timer device calls timerclock_attach when it is found. It
+ * provides SETTIMER, which arranges for one call to timerclock(),
+ * USECS microseconds from now, replacing any earlier arrangement.
+ */
+void timerclock_attach(void (*settimer)(void *devdata, uint32_t usecs),
+		       void *devdata);
+
+/*
+ * One-shot timers.
+ *
+ *    timer_init   - set up a timer to call FUNC(DATA) when it expires.
+ *    timer_start  - arm the timer to expire USECS microseconds from now.
+ *                   It must not already be pending.
+ *    timer_cancel - disarm the timer. Returns true if it was pending.
+ *                   Once this returns, the callback is not running and
+ *                   will not run, so the timer may be freed.
+ *
+ * Callbacks run in interrupt context with the timer system locked.
+ * They must not sleep, and must not start or cancel timers. Waking
+ * threads up is fine.
+ *
+ * The struct is only public so timers can be embedded in other
+ * structures; its contents are private to kern/thread/clock.c.
+ */
+struct timer {
+	struct timer *tm_next;		/* wheel bucket links */
+	struct timer *tm_prev;
+	uint64_t tm_expires;		/* deadline, from nanotime() */
+	void (*tm_func)(void *);
+	void *tm_data;
+	bool tm_pending;
+};
+
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+void timer_start(struct timer *tm, uint64_t usecs);
+bool timer_cancel(struct timer *tm);
+
+/*
+ * Timed waits on a wait channel. To sleep on WC for at most USECS:
+ *
+ *	timedwait_start(&tw, wc, usecs);
+ *	wchan_lock(wc);
+ *	(check the condition; release any other locks)
+ *	timedwait_sleep(&tw);
+ *	timedout = timedwait_finish(&tw);
+ *
+ * timedwait_sleep unlocks WC, like wchan_sleep, and returns when the
+ * thread is woken by someone else or the time is up, whichever is
+ * first. (If the time is already up, it doesn't sleep at all.) The
+ * timer wakes only this thread, not others on the channel.
+ * timedwait_finish must be called before TW goes away, and returns
+ * true if the time ran out.
+ */
+struct timedwait {
+	struct timer tw_timer;
+	struct thread *tw_thread;
+	struct wchan *tw_wchan;
+	bool tw_asleep;			/* see kern/thread/clock.c */
+	bool tw_expired;
+};
+
+void timedwait_start(struct timedwait *tw, struct wchan *wc, uint64_t usecs);
+void timedwait_sleep(struct timedwait *tw);
+bool timedwait_finish(struct timedwait *tw);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+uint64_t nanotime(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
@@ -71,14 +142,15 @@ void getinterval(time_t secs1, uint32_t nsecs,
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
  *
- *  this will be more efficient than clocknap() for longer sleeps
+ * clockusleep() does the same for a number of microseconds.
  */
 void clocksleep(int seconds);
+void clockusleep(uint64_t usecs);
 
 /*
  * clocknap() suspends execution for the requested number of timer ticks
  *
- * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
+ * a tick is LT_GRANULARITY usec (see kern/dev/ltimer.h)
  *
  */
 void clocknap(int ticks);
@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
 
 
 /*
@@ -46,6 +47,25 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/*
+ * Scheduler statistics for a cpu. Times are in nanoseconds.
+ * cs_waithist is a histogram of how long threads waited on the run
+ * queue before being dispatched here: bucket 0 counts waits of under
+ * 2 microseconds, bucket N (N > 0) waits of 2^N to 2^(N+1)-1
+ * microseconds, and the last bucket everything longer.
+ */
+#define CPUSTATS_NBUCKETS 20
+
+struct cpustats {
+	unsigned cs_nvcsw;		/* Voluntary context switches */
+	unsigned cs_nivcsw;		/* Involuntary context switches */
+	unsigned cs_ndispatch;		/* Threads dispatched */
+	uint64_t cs_runtime;		/* Time running threads */
+	uint64_t cs_idletime;		/* Time idle */
+	uint64_t cs_waittime;		/* Run queue wait of dispatched threads */
+	unsigned cs_waithist[CPUSTATS_NBUCKETS];
+};
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -59,7 +79,24 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_spares;	/* Dead threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_steals;		/* Threads stolen from other cpus */
+	struct cpustats c_stats;	/* Scheduler statistics */
+#if OPT_A3
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * TLB slots c_tlb_nused and up have been empty since the
+	 * last full flush; once they are all used, c_tlb_victim is
+	 * the next slot to replace (round-robin).
+	 * c_tlb_asid is the address space ID in c0_entryhi, and
+	 * c_tlb_asidgen the ASID generation the TLB contents are from.
+	 */
+	unsigned c_tlb_nused;
+	unsigned c_tlb_victim;
+	unsigned c_tlb_asid;
+	unsigned c_tlb_asidgen;
+#endif /* OPT_A3 */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +105,7 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_stolen;		/* Threads stolen by other cpus */
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +120,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_seq counts the batches of shootdowns queued for
+	 * this cpu, and c_shootdown_done is the count as of the last
+	 * time it carried out its queue.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;
+	unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -114,6 +158,12 @@ void cpu_hatch(unsigned software_number);
  */
 const char *cpu_identify(void);
 
+/*
+ * Return the number of CPUs. Only final once thread_start_cpus has
+ * run.
+ */
+unsigned cpu_numcpus(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
@@ -152,6 +202,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues N shootdowns for every CPU in CPUS (a
+ *     bitmask of cpu numbers), sending each at most one IPI, and waits
+ *     until they have all been carried out. The current CPU may be in
+ *     CPUS; it does its part directly. Must be called with interrupts
+ *     enabled. Returns the number of IPIs sent.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +221,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(uint32_t cpus,
+				const struct tlbshootdown *mappings,
+				unsigned n);
 
 void interprocessor_interrupt(void);
 
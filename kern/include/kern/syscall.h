@@ -197,6 +197,13 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Threads --
+#define SYS___thread_create 121
+#define SYS_thread_exit  122
+#define SYS_thread_join  123
+#define SYS_futex_wait   124
+#define SYS_futex_wake   125
+
 /*CALLEND*/
 
 
@@ -0,0 +1,63 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of a single type. Objects are packed
+ * into page-sized slabs at their exact size rather than being rounded
+ * up to a kmalloc size class.
+ *
+ * If the cache has a constructor, each object is constructed once,
+ * when its slab is made, and the destructor runs only when the slab is
+ * given back to the page allocator. In between, an object passes
+ * through any number of kmem_cache_alloc/kmem_cache_free cycles, and
+ * must be returned to the cache in its constructed state. The
+ * constructor returns 0 or an error code; it and the destructor may
+ * sleep.
+ *
+ *    KMEM_CACHE_INITIALIZER - static initializer for a cache of
+ *                             objects of type TYPE. Caches need no
+ *                             other setup and so can be used at any
+ *                             point during boot.
+ *
+ *    kmem_cache_alloc       - get an object, or NULL if out of memory.
+ *                             May sleep.
+ *
+ *    kmem_cache_free        - give an object back. May sleep.
+ *
+ *    kmem_printstats        - print usage of every cache in use.
+ *
+ * The structure is only public so that it can be statically
+ * initialized; its contents are private to kern/vm/kmem.c.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;	/* Opaque */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects everything below */
+	size_t kc_stride;		/* object plus link word, aligned */
+	unsigned kc_perslab;		/* objects per slab */
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	unsigned kc_nslabs;		/* slabs in the cache */
+	unsigned kc_nempty;		/* slabs with no objects in use */
+	unsigned kc_inuse;		/* objects allocated */
+	struct kmem_cache *kc_next;	/* list of caches in use */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, type, ctor, dtor) \
+	{ name, sizeof(type), ctor, dtor, SPINLOCK_INITIALIZER, \
+	  0, 0, NULL, 0, 0, 0, NULL }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_printstats(void);
+
+#endif /* _KMEM_H_ */
@@ -122,10 +122,18 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ * kmalloc_cpuinit sets up the per-cpu block caches for a new cpu;
+ * kmalloc_trim empties the current cpu's caches when memory is short,
+ * and has the other cpus empty theirs on their next kmalloc or kfree.
+ * kheap_printprofile dumps per-call-site usage if the kernel was
+ * configured with "options kmprof".
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_printprofile(void);
+void kmalloc_cpuinit(unsigned cpunum);
+void kmalloc_trim(void);
 
 /*
  * C string functions. 
@@ -50,6 +50,22 @@ struct vnode;
 struct semaphore;
 #endif // UW
 
+#if OPT_A2
+/*
+ * A thread started with __thread_create, from then until it has
+ * been joined or the process goes away. ut_stack is the top of its
+ * user stack. The fields are protected by the process's p_lock.
+ */
+struct uthread {
+  int ut_tid;
+  vaddr_t ut_stack;
+  bool ut_exited;
+  bool ut_joining;             /* someone is in thread_join for it */
+  int ut_status;               /* from thread_exit */
+  struct uthread *ut_next;
+};
+#endif /* OPT_A2 */
+
 /*
  * Process structure.
  */
@@ -64,6 +80,16 @@ struct proc {
   volatile int p_exitcode;
 
   struct wchan *p_wchan;
+
+  /*
+   * Threads. Once p_exiting is set by _exit, every thread leaves the
+   * process the next time it is on its way back to user mode, and
+   * the last one out finishes the exit. Protected by p_lock.
+   */
+  volatile bool p_exiting;
+  struct uthread *p_uthreads;   /* created and not yet joined */
+  int p_nexttid;
+  struct wchan *p_joinchan;     /* thread_join sleeps here */
 #endif /* OPT_A2 */
 	struct spinlock p_lock;		/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
@@ -106,8 +132,8 @@ void proc_destroy(struct proc *proc);
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
-/* Detach a thread from its process. */
-void proc_remthread(struct thread *t);
+/* Detach a thread from its process. Returns the number of threads left. */
+unsigned proc_remthread(struct thread *t);
 
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
@@ -0,0 +1,40 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages are written to page-sized slots on a raw disk device. Each
+ * slot has a reference count so that a page that was swapped out can
+ * stay shared copy-on-write between address spaces after a fork.
+ *
+ *    swap_bootstrap - open the swap device. If there isn't one, swap
+ *                     is disabled and swap_alloc always fails.
+ *
+ *    swap_alloc     - reserve a free slot, with one reference.
+ *
+ *    swap_incref    - add a reference to a slot.
+ *
+ *    swap_free      - drop a reference to a slot, releasing it when
+ *                     the last one goes away.
+ *
+ *    swap_read      - copy a slot into the physical page PADDR.
+ *
+ *    swap_write     - copy the physical page PADDR into a slot.
+ *
+ * swap_read and swap_write sleep; the others may be called anywhere.
+ */
+
+#include <types.h>
+
+/* Raw device that holds swap */
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_incref(unsigned slot);
+void swap_free(unsigned slot);
+int swap_read(unsigned slot, paddr_t paddr);
+int swap_write(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAP_H_ */
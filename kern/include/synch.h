@@ -71,6 +71,12 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * A thread that finds the lock held by a thread running on another
+ * cpu spins for a while, since the lock is likely to come free soon,
+ * before going to sleep. A sleeping waiter is handed the lock
+ * directly when it is released, so a thread that comes along in the
+ * meantime can't take it first.
  */
 struct lock {
         char *lk_name;
@@ -127,6 +133,9 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but give up waiting after USECS
+ *                   microseconds. Returns 0 if woken up, or ETIMEDOUT.
+ *                   The lock is reacquired either way.
  *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
@@ -137,6 +146,7 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, uint64_t usecs);
 
 
 #endif /* _SYNCH_H_ */
@@ -33,6 +33,7 @@
 #include "opt-A2.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct proc; /* from <proc.h> */
 
 /*
  * The system call dispatcher.
@@ -47,6 +48,11 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(void *, unsigned long);
 
+#if OPT_A2
+/* Helper for __thread_create(). */
+void enter_new_thread(void *tf, unsigned long tid);
+#endif /* OPT_A2 */
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -58,6 +64,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -69,6 +76,21 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 #if OPT_A2
 int sys_execv(userptr_t progname, userptr_t args);
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys___thread_create(struct trapframe *tf, userptr_t start,
+			userptr_t func, userptr_t arg, int *retval);
+void sys_thread_exit(int status);
+int sys_thread_join(int tid, userptr_t status);
+int sys_futex_wait(userptr_t uaddr, int val, userptr_t timeout);
+int sys_futex_wake(userptr_t uaddr, int count, int *retval);
+
+/* Set up the futex wait table. */
+void futex_bootstrap(void);
+
+/* Wake every thread of an exiting process that is in futex_wait. */
+void futex_wakeproc(struct proc *p);
+
+/* Leave the process if it is exiting; called on the way to user mode. */
+void proc_exitcheck(void);
 #endif /* OPT_A2 */
 
 #endif /* _SYSCALL_H_ */
@@ -64,6 +64,19 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Scheduler statistics for a thread. Times are in nanoseconds.
+ * A voluntary context switch is one where the thread sleeps, yields
+ * or exits; an involuntary one is preemption by the timer.
+ */
+struct threadstats {
+	unsigned ts_nvcsw;		/* Voluntary context switches */
+	unsigned ts_nivcsw;		/* Involuntary context switches */
+	unsigned ts_migrations;		/* Times moved to another cpu */
+	uint64_t ts_runtime;		/* Time spent running */
+	uint64_t ts_waittime;		/* Time spent on run queues */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -83,6 +96,35 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	int t_tid;			/* ID in process; 0 for the first */
+
+	/*
+	 * Scheduler fields. t_priority is the thread's level in the
+	 * multi-level feedback queue, 0 being the highest; t_ticks is
+	 * the number of hardclocks it has used at that level. Changed
+	 * only by the thread itself, or with its cpu's run queue locked.
+	 */
+	unsigned t_priority;		/* MLFQ level */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+
+	/*
+	 * Affinity hint: t_cpu's c_hardclocks when the thread last
+	 * stopped running there. Idle cpus are reluctant to steal a
+	 * thread that ran very recently, as its cache footprint is
+	 * probably still warm on its old cpu.
+	 */
+	unsigned t_lastrun;
+
+	/* Set if the thread must stay on t_cpu; never stolen. */
+	bool t_pinned;
+
+	/*
+	 * Statistics, and the times they are measured from. Updated
+	 * in thread_switch and thread_make_runnable.
+	 */
+	struct threadstats t_stats;
+	uint64_t t_readysince;		/* When last made runnable */
+	uint64_t t_runsince;		/* When last started running */
 
 	/*
 	 * Interrupt state fields.
@@ -144,6 +186,15 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread starts on cpu number CPUNUM
+ * and stays there: it is never migrated to another cpu. For per-cpu
+ * kernel threads. Returns EINVAL if there is no such cpu.
+ */
+int thread_fork_oncpu(const char *name, struct proc *proc, unsigned cpunum,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -163,10 +214,17 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current timer tick to the current thread, and yield if
+ * it has used up its quantum or a higher-priority thread is waiting.
+ * Called from the timer interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Print scheduler statistics for each cpu, and for the threads that
+ * are running or waiting to run.
  */
-void thread_consider_migration(void);
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -49,6 +50,13 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Change the symbolic name of a wait channel, as when a wait channel
+ * is reused for something else. The same rules apply to NAME as for
+ * wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -77,9 +85,20 @@ void wchan_sleep(struct wchan *wc);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if there was
+ * none. The thread may run and go away at once, so only look at it if
+ * something else (such as a lock it's waiting for) keeps it around.
  */
-void wchan_wakeone(struct wchan *wc);
+struct thread *wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up thread TARGET if it is sleeping on the wait channel, and
+ * return true; if it isn't, do nothing and return false. The queue
+ * should not already be locked.
+ */
+bool wchan_wakethread(struct wchan *wc, struct thread *target);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,69 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Kernel work queues: a way to have a function called later, by a
+ * kernel thread, instead of now by the caller.
+ *
+ * Each cpu has a queue, served by a few worker threads pinned to it.
+ * Work is put on the queue of the cpu that queues it. A work item is
+ * a struct work, normally embedded in whatever the work is about, so
+ * queueing never needs to allocate memory.
+ *
+ *    work_init          - set up a work item that will call FUNC(DATA).
+ *
+ *    work_queue         - queue a work item. It must not already be
+ *                         queued. Does not sleep, and may be called
+ *                         from interrupt handlers and timer callbacks.
+ *
+ *    work_queue_delayed - queue a work item once USECS microseconds
+ *                         have passed.
+ *
+ *    work_defer         - call FUNC(DATA) from a worker thread, using
+ *                         a work item allocated here. Returns ENOMEM
+ *                         if there's no memory for it, in which case
+ *                         the caller should do the work itself.
+ *
+ * The work function runs in a kernel thread and may sleep. A work
+ * item is no longer considered queued once its function starts, so
+ * the function may queue it again, or free it.
+ *
+ *    workqueue_bootstrap  - create the queues and their workers.
+ *                           Call once all cpus are running.
+ *
+ *    workqueue_flush      - wait until all work queued anywhere before
+ *                           the call has run. Delayed work still
+ *                           waiting for its timer is not waited for.
+ *                           Sleeps, so the caller must not hold
+ *                           anything the work might need. Returns
+ *                           false without waiting if called from a
+ *                           work function, true otherwise.
+ *
+ *    workqueue_printstats - print queue depths, counts and latencies.
+ */
+
+#include <clock.h>
+
+struct workqueue;	/* Opaque */
+
+struct work {
+	struct work *w_next;		/* on the queue */
+	void (*w_func)(void *);
+	void *w_data;
+	struct workqueue *w_wq;		/* queue it goes on */
+	uint64_t w_queuetime;		/* nanotime() when queued */
+	struct timer w_timer;		/* for work_queue_delayed */
+	bool w_pending;			/* queued or waiting for timer */
+	bool w_delayed;			/* waiting for timer */
+};
+
+void work_init(struct work *w, void (*func)(void *), void *data);
+void work_queue(struct work *w);
+void work_queue_delayed(struct work *w, uint64_t usecs);
+int work_defer(void (*func)(void *), void *data);
+
+void workqueue_bootstrap(void);
+bool workqueue_flush(void);
+void workqueue_printstats(void);
+
+#endif /* _WORKQUEUE_H_ */
@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -50,6 +51,7 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>
+#include <kmem.h>
 #include "opt-A2.h"
 
 /*
@@ -74,6 +76,61 @@ static volatile pid_t next_free_pid;
 static struct spinlock next_free_pid_lock;
 #endif /* OPT_A2 */
 
+/*
+ * Proc structures come from an object cache. The constructor sets up
+ * the parts that survive being freed and reallocated: the lock, the
+ * (empty) thread array, and under A2 the (empty) child array and the
+ * wait channels.
+ */
+static int proc_ctor(void *obj);
+static void proc_dtor(void *obj);
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", struct proc, proc_ctor, proc_dtor);
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_A2
+	proc->p_children = array_create();
+	if (proc->p_children == NULL) {
+		return ENOMEM;
+	}
+	proc->p_wchan = wchan_create("Process Waitchannel");
+	if (proc->p_wchan == NULL) {
+		array_destroy(proc->p_children);
+		return ENOMEM;
+	}
+	proc->p_joinchan = wchan_create("thread_join");
+	if (proc->p_joinchan == NULL) {
+		wchan_destroy(proc->p_wchan);
+		array_destroy(proc->p_children);
+		return ENOMEM;
+	}
+#endif /* OPT_A2 */
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+#if OPT_A2
+	wchan_destroy(proc->p_joinchan);
+	wchan_destroy(proc->p_wchan);
+	array_destroy(proc->p_children);
+#endif /* OPT_A2 */
+}
+
 
 
 /*
@@ -85,19 +142,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -153,9 +207,16 @@ proc_destroy(struct proc *proc)
 			proc_destroy(child);
 		}
 	}
-	array_destroy(proc->p_children);
-
-	wchan_destroy(proc->p_wchan);
+	KASSERT(array_num(proc->p_children) == 0);
+	KASSERT(wchan_isempty(proc->p_wchan));
+
+	/* Threads nobody joined */
+	while (proc->p_uthreads != NULL) {
+		struct uthread *ut = proc->p_uthreads;
+		proc->p_uthreads = ut->ut_next;
+		kfree(ut);
+	}
+	KASSERT(wchan_isempty(proc->p_joinchan));
 #endif /* OPT_A2 */
 
 #ifndef UW  // in the UW version, space destruction occurs in sys_exit, not here
@@ -184,11 +245,10 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -257,12 +317,13 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&next_free_pid_lock);
 
 	proc->p_parent = NULL;
-	proc->p_children = array_create();
 
 	proc->p_exited = false;
 	proc->p_exitcode = 0;
 
-	proc->p_wchan = wchan_create("Process Waitchannel");
+	proc->p_exiting = false;
+	proc->p_uthreads = NULL;
+	proc->p_nexttid = 1;
 #endif /* OPT_A2 */
 
 #ifdef UW
@@ -335,9 +396,10 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 /*
  * Remove a thread from its process. Either the thread or the process
- * might or might not be current.
+ * might or might not be current. Returns the number of threads still
+ * in the process, so that the last one can tell it was.
  */
-void
+unsigned
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
@@ -354,12 +416,13 @@ proc_remthread(struct thread *t)
 			threadarray_remove(&proc->p_threads, i);
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
-			return;
+			return num - 1;
 		}
 	}
 	/* Did not find it. */
 	spinlock_release(&proc->p_lock);
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
+	return 0;
 }
 
 /*
@@ -45,11 +45,17 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <workqueue.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif /* OPT_A3 */
 
 
 /*
@@ -125,10 +131,17 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
+#if OPT_A2
+	futex_bootstrap();
+#endif /* OPT_A2 */
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+	/* Flush dirty buffers every so often from now on */
+	vfs_writeback_start();
+
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -146,13 +159,24 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
-	
+
+	/*
+	 * Let deferred work finish first: address spaces of exited
+	 * processes still hold vnodes that would keep unmount from
+	 * succeeding, and pages vmstats should see freed.
+	 */
+	workqueue_flush();
+
 	vfs_clearbootfs();
 	vfs_clearcurdir();
 	vfs_unmountall();
 
 	thread_shutdown();
 
+#if OPT_A3
+	vmstats_print();
+#endif /* OPT_A3 */
+
 	splhigh();
 }
 
@@ -39,6 +39,7 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <workqueue.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -396,6 +397,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printprofile();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -465,6 +478,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] CV timed wait test    (1)     ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -505,7 +519,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[dth] Show thread debug messages    ",
+	"[ss] Scheduler statistics           ",
 	"[kh] Kernel heap stats              ",
+	"[kmp] Kernel heap profile           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -536,6 +552,19 @@ showthreaddb(int n, char **a)
 	return 0;
 }
 
+static
+int
+showschedstats(int n, char **a)
+{
+	(void)n;
+	(void)a;
+
+	thread_printstats();
+	kprintf("\n");
+	workqueue_printstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Command table.
@@ -568,6 +597,7 @@ static struct {
 
 	/* user-added operations */
 	{ "dth",	showthreaddb },
+	{ "ss",		showschedstats },
 
 #if OPT_SYNCHPROBS
 	/* in-kernel synchronization problem(s) */
@@ -580,6 +610,7 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kmp",	cmd_kheapprofile },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -597,6 +628,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	cvtimedtest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
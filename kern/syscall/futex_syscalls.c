@@ -0,0 +1,270 @@
+/*
+ * Futexes: sleeping and waking on a word of user memory.
+ *
+ * futex_wait(addr, val, timeout) sleeps as long as the int at ADDR
+ * still holds VAL; futex_wake(addr, count) wakes up to COUNT threads
+ * sleeping on ADDR. User-level locks keep their state in that word and
+ * only make these calls when they have to wait or when someone else
+ * is waiting, so locks nobody contends never enter the kernel.
+ *
+ * Waiters are kept in a fixed table of buckets hashed on the address.
+ * A futex belongs to its process, so the key is the process as well as
+ * the address, and processes never see each other's waiters. Each
+ * bucket has a lock, held while checking the user's word and while
+ * queueing or waking waiters, which is what keeps a wake from slipping
+ * in between a waiter's check and its sleep. Reading the word may
+ * fault, so the lock is a sleep lock rather than a spinlock.
+ *
+ * A waiter's record lives on its own stack; it is on its bucket's list
+ * only while it sleeps, and whoever takes it off the list says why.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+
+#define FUTEX_NBUCKETS	64	/* must be a power of 2 */
+
+struct futex_waiter {
+	struct proc *fw_proc;		/* key: process */
+	userptr_t fw_uaddr;		/* key: user address */
+	struct thread *fw_thread;
+	bool fw_queued;			/* on the bucket's list */
+	bool fw_woken;			/* taken off by futex_wake */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;		/* protects fb_waiters */
+	struct wchan *fb_wchan;		/* waiters sleep here */
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_lock == NULL ||
+		    futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct proc *p, userptr_t uaddr)
+{
+	unsigned h;
+
+	h = ((uintptr_t)uaddr >> 2) ^ ((uintptr_t)p >> 5);
+	return &futex_table[h & (FUTEX_NBUCKETS - 1)];
+}
+
+/*
+ * Take FW off FB's list. Call with fb_lock held.
+ */
+static
+void
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *fw)
+{
+	struct futex_waiter **fwp;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+	KASSERT(fw->fw_queued);
+
+	for (fwp = &fb->fb_waiters; *fwp != fw; fwp = &(*fwp)->fw_next) {
+		KASSERT(*fwp != NULL);
+	}
+	*fwp = fw->fw_next;
+	fw->fw_next = NULL;
+	fw->fw_queued = false;
+}
+
+/*
+ * Sleep on UADDR if the int there is still VAL. TIMEOUT, if not NULL,
+ * is a relative struct timespec after which to give up.
+ *
+ * Returns 0 if woken by futex_wake, EAGAIN if the value had already
+ * changed, ETIMEDOUT if the time ran out, and EINTR if the process is
+ * exiting.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val, userptr_t timeout)
+{
+	struct proc *p = curproc;
+	struct futex_bucket *fb;
+	struct futex_waiter fw;
+	struct timedwait tw;
+	struct timespec ts;
+	bool timed, timedout;
+	int curval;
+	int result;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	timed = (timeout != NULL);
+	if (timed) {
+		result = copyin(timeout, &ts, sizeof(ts));
+		if (result) {
+			return result;
+		}
+		if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+		    ts.tv_nsec >= 1000000000) {
+			return EINVAL;
+		}
+	}
+
+	fb = futex_hash(p, uaddr);
+
+	lock_acquire(fb->fb_lock);
+
+	result = copyin(uaddr, &curval, sizeof(curval));
+	if (result == 0 && curval != val) {
+		result = EAGAIN;
+	}
+	if (result == 0 && p->p_exiting) {
+		result = EINTR;
+	}
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+
+	fw.fw_proc = p;
+	fw.fw_uaddr = uaddr;
+	fw.fw_thread = curthread;
+	fw.fw_queued = true;
+	fw.fw_woken = false;
+	fw.fw_next = fb->fb_waiters;
+	fb->fb_waiters = &fw;
+
+	/*
+	 * Lock the channel before letting go of the bucket, so a wake
+	 * that comes in between finds us on the channel.
+	 */
+	if (timed) {
+		/* Round up to whole microseconds so we never wait short. */
+		timedwait_start(&tw, fb->fb_wchan,
+				(uint64_t)ts.tv_sec * 1000000 +
+				(ts.tv_nsec + 999) / 1000);
+		wchan_lock(fb->fb_wchan);
+		lock_release(fb->fb_lock);
+		timedwait_sleep(&tw);
+		timedout = timedwait_finish(&tw);
+	}
+	else {
+		wchan_lock(fb->fb_wchan);
+		lock_release(fb->fb_lock);
+		wchan_sleep(fb->fb_wchan);
+		timedout = false;
+	}
+
+	lock_acquire(fb->fb_lock);
+	if (fw.fw_queued) {
+		/* Nobody took us off, so the timer woke us. */
+		KASSERT(timedout);
+		futex_unlink(fb, &fw);
+	}
+	lock_release(fb->fb_lock);
+
+	if (fw.fw_woken) {
+		/* A wake counts even if the time ran out too. */
+		return 0;
+	}
+	return timedout ? ETIMEDOUT : EINTR;
+}
+
+/*
+ * Wake up to COUNT threads sleeping on UADDR, oldest first. Sets
+ * *RETVAL to the number woken.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int count, int *retval)
+{
+	struct proc *p = curproc;
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, *next, *oldest;
+	int woken;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fb = futex_hash(p, uaddr);
+	woken = 0;
+
+	lock_acquire(fb->fb_lock);
+	while (woken < count) {
+		/* New waiters go on the front, so the oldest is the last. */
+		oldest = NULL;
+		for (fw = fb->fb_waiters; fw != NULL; fw = next) {
+			next = fw->fw_next;
+			if (fw->fw_proc == p && fw->fw_uaddr == uaddr) {
+				oldest = fw;
+			}
+		}
+		if (oldest == NULL) {
+			break;
+		}
+		futex_unlink(fb, oldest);
+		oldest->fw_woken = true;
+		wchan_wakethread(fb->fb_wchan, oldest->fw_thread);
+		woken++;
+	}
+	lock_release(fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
+
+/*
+ * Turn out every thread of P that is sleeping in futex_wait, so that
+ * it notices the process is exiting. Called by _exit once p_exiting
+ * is set.
+ */
+void
+futex_wakeproc(struct proc *p)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, *next;
+	unsigned i;
+
+	KASSERT(p->p_exiting);
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		fb = &futex_table[i];
+		lock_acquire(fb->fb_lock);
+		for (fw = fb->fb_waiters; fw != NULL; fw = next) {
+			next = fw->fw_next;
+			if (fw->fw_proc == p) {
+				futex_unlink(fb, fw);
+				wchan_wakethread(fb->fb_wchan, fw->fw_thread);
+			}
+		}
+		lock_release(fb->fb_lock);
+	}
+}
+
+#endif /* OPT_A2 */
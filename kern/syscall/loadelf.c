@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +75,39 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_A3
+/*
+ * Register a segment at virtual address VADDR. The segment in memory
+ * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
+ * segment on disk is located at file offset OFFSET and has length
+ * FILESIZE.
+ *
+ * Nothing is read here: the address space remembers where the data
+ * lives and vm_fault reads each page in the first time it is touched.
+ * Pages past FILESIZE are zero-filled at fault time. Because uiomove
+ * no longer sees the user addresses, as_define_region is responsible
+ * for rejecting segments that reach into kernel space.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr, 
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_backing(as, vaddr, v, offset, filesize);
+}
+#else
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +178,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* OPT_A3 */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -10,6 +10,7 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include <mips/trapframe.h>
+#include <workqueue.h>
 #include "opt-A2.h"
 #if OPT_A2
 #include <array.h>
@@ -18,23 +19,40 @@
 #include <wchan.h>
 #endif /* OPT_A2 */
 
-/* this implementation of sys__exit does not do anything with the exit code */
-/* this needs to be fixed to get exit() and waitpid() working properly */
-void sys__exit(int exitcode) {
-  struct addrspace *as;
-  struct proc *p = curproc;
+/*
+ * Tearing down an address space can take a while (every page, and
+ * maybe swap space, goes back), and nobody is waiting on it, so the
+ * exiting process hands it to a worker thread instead of doing it
+ * itself before its parent can collect the exit status.
+ *
+ * So the address space may outlive the process for a while. Anyone
+ * who needs it gone waits with workqueue_flush: the VM system does
+ * when memory runs out, and shutdown does before unmounting.
+ */
+static void
+sys__exit_destroyas(void *as)
+{
+  as_destroy(as);
+}
 
 #if OPT_A2
-#else
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
-  (void)exitcode;
-#endif /* OPT_A2 */
+/*
+ * Take the current thread out of its process. If it was the last one,
+ * finish off the process: the address space goes, and the parent can
+ * collect p_exitcode. Does not return.
+ */
+static void
+proc_leave(void)
+{
+  struct addrspace *as;
+  struct proc *p = curproc;
 
-  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+  /* note: curproc cannot be used after this call */
+  if (proc_remthread(curthread) > 0) {
+    /* the last thread out will do the rest */
+    thread_exit();
+  }
 
-  KASSERT(curproc->p_addrspace != NULL);
-  as_deactivate();
   /*
    * clear p_addrspace before calling as_destroy. Otherwise if
    * as_destroy sleeps (which is quite possible) when we
@@ -42,17 +60,19 @@ void sys__exit(int exitcode) {
    * half-destroyed address space. This tends to be
    * messily fatal.
    */
-  as = curproc_setas(NULL);
-  as_destroy(as);
-
-  /* detach this thread from its process */
-  /* note: curproc cannot be used after this call */
-  proc_remthread(curthread);
+  as_deactivate();
+  spinlock_acquire(&p->p_lock);
+  as = p->p_addrspace;
+  p->p_addrspace = NULL;
+  spinlock_release(&p->p_lock);
+  KASSERT(as != NULL);
+  if (work_defer(sys__exit_destroyas, as)) {
+    /* no memory to defer it; do it now */
+    as_destroy(as);
+  }
 
-#if OPT_A2
   spinlock_acquire(&p->p_lock);
   p->p_exited = true;
-  p->p_exitcode = exitcode;
   spinlock_release(&p->p_lock);
 
   unsigned num_children = array_num(p->p_children);
@@ -68,17 +88,266 @@ void sys__exit(int exitcode) {
   if (!p->p_parent) {
     proc_destroy(p);
   }
+
+  thread_exit();
+}
+
+/*
+ * _exit ends the whole process, not just the calling thread. The
+ * other threads leave as they next head back to user mode (those in
+ * thread_join and futex_wait are woken up to do so); the first exit
+ * code given is the one the parent sees.
+ *
+ * Threads asleep anywhere else are not woken. One blocked in waitpid,
+ * or in a read from the console, holds up the end of the process, and
+ * so its parent's waitpid, until that call returns of its own accord.
+ */
+void sys__exit(int exitcode) {
+  struct proc *p = curproc;
+
+  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+
+  spinlock_acquire(&p->p_lock);
+  if (!p->p_exiting) {
+    p->p_exiting = true;
+    p->p_exitcode = exitcode;
+  }
+  spinlock_release(&p->p_lock);
+
+  wchan_wakeall(p->p_joinchan);
+  futex_wakeproc(p);
+
+  proc_leave();
+
+  /* proc_leave() does not return, so we should never get here */
+  panic("return from proc_leave in sys_exit\n");
+}
+
+void
+proc_exitcheck(void)
+{
+  if (curproc->p_exiting) {
+    proc_leave();
+  }
+}
+
+/*
+ * Start a new thread in this process, at user address START with
+ * FUNC and ARG as its first two arguments and a stack of its own. The
+ * libc wrapper passes a START that calls FUNC(ARG) and then
+ * thread_exit, since the thread has nowhere to return to.
+ */
+int
+sys___thread_create(struct trapframe *tf, userptr_t start,
+                    userptr_t func, userptr_t arg, int *retval)
+{
+  struct proc *p = curproc;
+  struct addrspace *as = curproc_getas();
+  struct trapframe *newtf;
+  struct uthread *ut, **utp;
+  vaddr_t stackptr;
+  int result;
+
+  ut = kmalloc(sizeof(struct uthread));
+  newtf = kmalloc(sizeof(struct trapframe));
+  if (ut == NULL || newtf == NULL) {
+    kfree(ut);
+    kfree(newtf);
+    return ENOMEM;
+  }
+
+  result = as_define_threadstack(as, &stackptr);
+  if (result) {
+    kfree(ut);
+    kfree(newtf);
+    return result;
+  }
+
+  /* Keep the caller's registers (notably gp) except where it starts */
+  *newtf = *tf;
+  newtf->tf_epc = (vaddr_t)start;
+  newtf->tf_a0 = (vaddr_t)func;
+  newtf->tf_a1 = (vaddr_t)arg;
+  newtf->tf_sp = stackptr;
+  newtf->tf_ra = 0;
+
+  ut->ut_stack = stackptr;
+  ut->ut_exited = false;
+  ut->ut_joining = false;
+  ut->ut_status = 0;
+
+  /*
+   * It has to be on the list before it can run and exit. Once the
+   * process is exiting no new threads join it.
+   */
+  spinlock_acquire(&p->p_lock);
+  if (p->p_exiting) {
+    spinlock_release(&p->p_lock);
+    as_destroy_threadstack(as, stackptr);
+    kfree(ut);
+    kfree(newtf);
+    return EINTR;
+  }
+  ut->ut_tid = p->p_nexttid++;
+  ut->ut_next = p->p_uthreads;
+  p->p_uthreads = ut;
+  spinlock_release(&p->p_lock);
+
+  result = thread_fork(p->p_name, p, enter_new_thread, newtf, ut->ut_tid);
+  if (result) {
+    spinlock_acquire(&p->p_lock);
+    for (utp = &p->p_uthreads; *utp != ut; utp = &(*utp)->ut_next) {
+      KASSERT(*utp != NULL);
+    }
+    *utp = ut->ut_next;
+    spinlock_release(&p->p_lock);
+    as_destroy_threadstack(as, stackptr);
+    kfree(ut);
+    kfree(newtf);
+    return result;
+  }
+
+  *retval = ut->ut_tid;
+  return 0;
+}
+
+/*
+ * Find user thread TID in P, which must be locked.
+ */
+static struct uthread *
+uthread_find(struct proc *p, int tid)
+{
+  struct uthread *ut;
+
+  KASSERT(spinlock_do_i_hold(&p->p_lock));
+  for (ut = p->p_uthreads; ut != NULL; ut = ut->ut_next) {
+    if (ut->ut_tid == tid) {
+      return ut;
+    }
+  }
+  return NULL;
+}
+
+void
+sys_thread_exit(int status)
+{
+  struct proc *p = curproc;
+  struct uthread *ut;
+
+  /* The first thread has no uthread (and its stack isn't ours to free) */
+  spinlock_acquire(&p->p_lock);
+  ut = uthread_find(p, curthread->t_tid);
+  spinlock_release(&p->p_lock);
+
+  if (ut != NULL) {
+    /* Not worth the trouble if the whole address space is going */
+    if (!p->p_exiting) {
+      as_destroy_threadstack(curproc_getas(), ut->ut_stack);
+    }
+
+    spinlock_acquire(&p->p_lock);
+    ut->ut_status = status;
+    ut->ut_exited = true;
+    spinlock_release(&p->p_lock);
+
+    wchan_wakeall(p->p_joinchan);
+  }
+
+  proc_leave();
+}
+
+/*
+ * Wait for thread TID to exit and collect its status. Only one thread
+ * may wait for a given thread, and once it has been joined its TID is
+ * forgotten.
+ */
+int
+sys_thread_join(int tid, userptr_t status)
+{
+  struct proc *p = curproc;
+  struct uthread *ut, **utp;
+  int exitstatus;
+
+  if (tid == curthread->t_tid) {
+    return EINVAL;
+  }
+
+  spinlock_acquire(&p->p_lock);
+  ut = uthread_find(p, tid);
+  if (ut == NULL || ut->ut_joining) {
+    spinlock_release(&p->p_lock);
+    return ut == NULL ? ESRCH : EINVAL;
+  }
+  ut->ut_joining = true;
+
+  while (!ut->ut_exited && !p->p_exiting) {
+    wchan_lock(p->p_joinchan);
+    spinlock_release(&p->p_lock);
+    wchan_sleep(p->p_joinchan);
+    spinlock_acquire(&p->p_lock);
+  }
+
+  if (!ut->ut_exited) {
+    /* The process is exiting, and so are we */
+    ut->ut_joining = false;
+    spinlock_release(&p->p_lock);
+    return EINTR;
+  }
+
+  exitstatus = ut->ut_status;
+  for (utp = &p->p_uthreads; *utp != ut; utp = &(*utp)->ut_next) {
+    KASSERT(*utp != NULL);
+  }
+  *utp = ut->ut_next;
+  spinlock_release(&p->p_lock);
+  kfree(ut);
+
+  if (status != NULL) {
+    return copyout(&exitstatus, status, sizeof(int));
+  }
+  return 0;
+}
 #else
+/* this implementation of sys__exit does not do anything with the exit code */
+/* this needs to be fixed to get exit() and waitpid() working properly */
+void sys__exit(int exitcode) {
+  struct addrspace *as;
+  struct proc *p = curproc;
+  /* for now, just include this to keep the compiler from complaining about
+     an unused variable */
+  (void)exitcode;
+
+  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+
+  KASSERT(curproc->p_addrspace != NULL);
+  as_deactivate();
+  /*
+   * clear p_addrspace before calling as_destroy. Otherwise if
+   * as_destroy sleeps (which is quite possible) when we
+   * come back we'll be calling as_activate on a
+   * half-destroyed address space. This tends to be
+   * messily fatal.
+   */
+  as = curproc_setas(NULL);
+  if (work_defer(sys__exit_destroyas, as)) {
+    /* no memory to defer it; do it now */
+    as_destroy(as);
+  }
+
+  /* detach this thread from its process */
+  /* note: curproc cannot be used after this call */
+  proc_remthread(curthread);
+
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
   proc_destroy(p);
-#endif /* OPT_A2 */
 
   thread_exit();
 
   /* thread_exit() does not return, so we should never get here */
   panic("return from thread_exit in sys_exit\n");
 }
+#endif /* OPT_A2 */
 
 #if OPT_A2
 int sys_getpid(pid_t *retval) {
@@ -182,6 +451,15 @@ int sys_execv(userptr_t progname, userptr_t args) {
   struct addrspace *as, *old_as;
   struct vnode *v;
   vaddr_t entrypoint, stackptr;
+  unsigned num_threads;
+
+  /* Any other threads would be left running in the old image */
+  spinlock_acquire(&curproc->p_lock);
+  num_threads = threadarray_num(&curproc->p_threads);
+  spinlock_release(&curproc->p_lock);
+  if (num_threads > 1) {
+    return EBUSY;
+  }
 
   size_t progname_len = strlen((char *)progname) + 1;
   kprogname = kmalloc(progname_len * sizeof(char));
@@ -268,7 +546,16 @@ int sys_execv(userptr_t progname, userptr_t args) {
     return result;
   }
 
-  enter_new_process(0, NULL, stackptr, entrypoint); /* HERE (need to pass num_args and pointer to argv) */
+  /* The arguments are on the user stack now */
+  for (unsigned i = 0; i < num_args; i++) {
+    kfree((char *)array_get(kargs, 0));
+    array_remove(kargs, 0);
+  }
+  array_remove(kargs, 0);
+  array_destroy(kargs);
+
+  /* as_define_stack leaves argv at the initial stack pointer */
+  enter_new_process(num_args, (userptr_t)stackptr, stackptr, entrypoint);
 
   panic("enter_new_process returned\n");
   return EINVAL;
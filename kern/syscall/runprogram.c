@@ -44,6 +44,7 @@
 #include <vfs.h>
 #include <syscall.h>
 #include <test.h>
+#include "opt-A2.h"
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -91,7 +92,11 @@ runprogram(char *progname)
 	vfs_close(v);
 
 	/* Define the user stack in the address space */
+#if OPT_A2
+	result = as_define_stack(as, &stackptr, 0, NULL);
+#else
 	result = as_define_stack(as, &stackptr);
+#endif
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		return result;
@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -347,3 +348,88 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+#define CVTIMEOUT_USECS   100000	/* for the timeout case */
+#define CVSIGNAL_USECS    10000000	/* long enough never to expire */
+
+static
+void
+cvtimedtestthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	/* We get the lock only once the main thread is waiting. */
+	lock_acquire(testlock);
+	testval1 = 1;
+	cv_signal(testcv, testlock);
+	lock_release(testlock);
+
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+cvtimedtest(int nargs, char **args)
+{
+	uint64_t start, elapsed;
+	int result, failed;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting CV timed wait test...\n");
+	failed = 0;
+
+	/* Nobody signals: must give up, and not before its time. */
+	lock_acquire(testlock);
+	start = nanotime();
+	result = cv_timedwait(testcv, testlock, CVTIMEOUT_USECS);
+	elapsed = nanotime() - start;
+	if (!lock_do_i_hold(testlock)) {
+		kprintf("cv_timedwait returned without the lock\n");
+		failed = 1;
+	}
+	lock_release(testlock);
+	if (result != ETIMEDOUT) {
+		kprintf("Unsignalled cv_timedwait returned %d (%s), "
+			"not ETIMEDOUT\n", result, strerror(result));
+		failed = 1;
+	}
+	if (elapsed < (uint64_t)CVTIMEOUT_USECS * 1000) {
+		kprintf("cv_timedwait of %u us timed out after %u us\n",
+			CVTIMEOUT_USECS, (unsigned)(elapsed / 1000));
+		failed = 1;
+	}
+
+	/* Signalled long before the timeout: must return 0. */
+	lock_acquire(testlock);
+	testval1 = 0;
+	result = thread_fork("synchtest", NULL, cvtimedtestthread, NULL, 0);
+	if (result) {
+		panic("cvtimedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = cv_timedwait(testcv, testlock, CVSIGNAL_USECS);
+	if (result != 0) {
+		kprintf("Signalled cv_timedwait returned %d (%s), not 0\n",
+			result, strerror(result));
+		failed = 1;
+	}
+	if (testval1 != 1) {
+		kprintf("cv_timedwait returned before the signal\n");
+		failed = 1;
+	}
+	lock_release(testlock);
+	P(donesem);
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("CV timed wait test %s\n", failed ? "FAILED" : "done");
+
+	return 0;
+}
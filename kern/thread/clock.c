@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -39,9 +40,11 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * hardclock() drives the scheduler. Timed operations are done with
+ * one-shot timers (struct timer), kept in a hashed timing wheel and
+ * driven by timerclock(). There is no periodic timer interrupt for
+ * this: the timer device is programmed for the earliest pending
+ * deadline, and not at all if there are no timers.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -52,62 +55,357 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * The timing wheel. Timers hash into TIMER_NSLOTS buckets by their
+ * deadline, each bucket covering 2^TIMER_SLOTSHIFT nanoseconds (about
+ * a millisecond), so the wheel goes round about every quarter second.
+ * A bucket holds timers for any number of revolutions ahead; only
+ * those actually due are fired. timer_slot is the slot number (the
+ * deadline shifted down, not yet reduced modulo the wheel size) of
+ * the first bucket not yet fully processed.
+ *
+ * Timer callbacks are called from timerclock() with timer_lock held,
+ * so that timer_cancel() can guarantee that a cancelled timer's
+ * callback is not running. Callbacks therefore must not sleep, and
+ * must not start or cancel timers; the lock order is timer_lock
+ * before wait channel and run queue locks.
  */
-static struct wchan *lbolt;
+#define TIMER_NSLOTS		256
+#define TIMER_SLOTSHIFT		20
+#define TIMER_BUCKET(ns)	(((ns) >> TIMER_SLOTSHIFT) % TIMER_NSLOTS)
+
+/* Longest interval to program into the timer device, in usec. */
+#define TIMER_MAXPROGRAM	1000000
+
+static struct spinlock timer_lock = SPINLOCK_INITIALIZER;
+static struct timer *timer_wheel[TIMER_NSLOTS];
+static unsigned timer_count;		/* timers pending */
+static uint64_t timer_slot;		/* next slot to process */
+static uint64_t timer_programmed;	/* deadline the device is set for */
+
+/* The device that calls timerclock(). */
+static void (*timer_settimer)(void *devdata, uint32_t usecs);
+static void *timer_devdata;
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timed sleeps (clocksleep, clocknap, nanosleep) all use this channel;
+ * each sleeper is woken individually by its own timer.
  */
-static struct wchan *minibolt;
+static struct wchan *timer_sleepchan;
 
-/* 
- * number of minibolts per second
+/*
+ * Setup.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+void
+hardclock_bootstrap(void)
+{
+	timer_sleepchan = wchan_create("timer");
+	if (timer_sleepchan == NULL) {
+		panic("Couldn't create timer wait channel\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Timers
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_next = NULL;
+	tm->tm_prev = NULL;
+	tm->tm_expires = 0;
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_pending = false;
+}
 
 /*
- * minibolt countdown
+ * Program the timer device for the earliest pending deadline. NOW is
+ * the current time. Called with timer_lock held.
  */
-static int minicount;
+static
+void
+timer_program(uint64_t now)
+{
+	struct timer *tm, *best;
+	uint64_t slot, usecs;
+	unsigned i;
+
+	if (timer_count == 0 || timer_settimer == NULL) {
+		timer_programmed = 0;
+		return;
+	}
+
+	/*
+	 * Walk the wheel from the current slot for the first bucket
+	 * holding a timer due in that slot's time this revolution. If
+	 * there's none, everything is at least a revolution away; take
+	 * the earliest deadline overall.
+	 */
+	best = NULL;
+	slot = timer_slot;
+	for (i=0; i<TIMER_NSLOTS && best == NULL; i++, slot++) {
+		for (tm = timer_wheel[slot % TIMER_NSLOTS]; tm != NULL;
+		     tm = tm->tm_next) {
+			if ((tm->tm_expires >> TIMER_SLOTSHIFT) <= slot &&
+			    (best == NULL || tm->tm_expires < best->tm_expires)) {
+				best = tm;
+			}
+		}
+	}
+	if (best == NULL) {
+		for (i=0; i<TIMER_NSLOTS; i++) {
+			for (tm = timer_wheel[i]; tm != NULL;
+			     tm = tm->tm_next) {
+				if (best == NULL ||
+				    tm->tm_expires < best->tm_expires) {
+					best = tm;
+				}
+			}
+		}
+	}
+	KASSERT(best != NULL);
+
+	timer_programmed = best->tm_expires;
+	usecs = best->tm_expires > now ? (best->tm_expires - now) / 1000 : 0;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	else if (usecs > TIMER_MAXPROGRAM) {
+		/* We'll just go round again. */
+		usecs = TIMER_MAXPROGRAM;
+		timer_programmed = now + usecs * 1000;
+	}
+	timer_settimer(timer_devdata, usecs);
+}
+
+void
+timer_start(struct timer *tm, uint64_t usecs)
+{
+	struct timer **bucket;
+	uint64_t now;
+
+	KASSERT(tm->tm_func != NULL);
+
+	now = nanotime();
+
+	spinlock_acquire(&timer_lock);
+	KASSERT(!tm->tm_pending);
+
+	if (timer_count == 0) {
+		/* Nothing to catch up on; start the wheel from now. */
+		timer_slot = now >> TIMER_SLOTSHIFT;
+	}
+
+	tm->tm_expires = now + usecs * 1000;
+	tm->tm_pending = true;
+	bucket = &timer_wheel[TIMER_BUCKET(tm->tm_expires)];
+	tm->tm_prev = NULL;
+	tm->tm_next = *bucket;
+	if (*bucket != NULL) {
+		(*bucket)->tm_prev = tm;
+	}
+	*bucket = tm;
+	timer_count++;
+
+	if (timer_programmed == 0 || tm->tm_expires < timer_programmed) {
+		timer_program(now);
+	}
+
+	spinlock_release(&timer_lock);
+}
 
 /*
- * Setup.
+ * Take a timer off the wheel. Called with timer_lock held.
  */
+static
 void
-hardclock_bootstrap(void)
+timer_remove(struct timer *tm)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	KASSERT(tm->tm_pending);
+
+	if (tm->tm_prev != NULL) {
+		tm->tm_prev->tm_next = tm->tm_next;
+	}
+	else {
+		timer_wheel[TIMER_BUCKET(tm->tm_expires)] = tm->tm_next;
+	}
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prev = tm->tm_prev;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	tm->tm_next = tm->tm_prev = NULL;
+	tm->tm_pending = false;
+	KASSERT(timer_count > 0);
+	timer_count--;
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	bool pending;
+
+	spinlock_acquire(&timer_lock);
+	pending = tm->tm_pending;
+	if (pending) {
+		/*
+		 * Leave the device programmed; if this was the
+		 * earliest timer, timerclock will find nothing due and
+		 * reprogram.
+		 */
+		timer_remove(tm);
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	spinlock_release(&timer_lock);
+	return pending;
 }
 
 /*
- * This is called once every every LT_GRANULARITY usec, on one processor,
- * by the timer code.
+ * Called by the timer device when the time it was last programmed
+ * for arrives, on whichever processor takes its interrupt.
  */
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct timer *tm, *next;
+	uint64_t now, nowslot;
+
+	now = nanotime();
+	nowslot = now >> TIMER_SLOTSHIFT;
+
+	spinlock_acquire(&timer_lock);
+
+	/*
+	 * Fire everything due, in the slots from timer_slot up to
+	 * now. If we're more than a revolution behind, one pass over
+	 * the whole wheel covers everything. The current slot isn't
+	 * done until its time is up, so timer_slot stops there.
+	 */
+	if (nowslot - timer_slot >= TIMER_NSLOTS) {
+		timer_slot = nowslot - (TIMER_NSLOTS - 1);
+	}
+	while (timer_slot <= nowslot && timer_count > 0) {
+		for (tm = timer_wheel[timer_slot % TIMER_NSLOTS]; tm != NULL;
+		     tm = next) {
+			next = tm->tm_next;
+			if (tm->tm_expires <= now) {
+				timer_remove(tm);
+				tm->tm_func(tm->tm_data);
+			}
+		}
+		if (timer_slot == nowslot) {
+			break;
+		}
+		timer_slot++;
+	}
+
+	timer_program(now);
+
+	spinlock_release(&timer_lock);
+}
+
+void
+timerclock_attach(void (*settimer)(void *devdata, uint32_t usecs),
+		  void *devdata)
+{
+	spinlock_acquire(&timer_lock);
+	KASSERT(timer_settimer == NULL);
+	timer_settimer = settimer;
+	timer_devdata = devdata;
+	timer_program(nanotime());
+	spinlock_release(&timer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Timed waits
+
+/*
+ * Timer callback for timed waits.
+ *
+ * tw_asleep is set, with the channel locked, just before the waiter
+ * goes to sleep. If it isn't set yet, we mark the wait expired and the
+ * waiter will see that and not sleep. Otherwise, the wait has only
+ * expired if we are the ones to wake the waiter; if someone else woke
+ * it first, it was not a timeout. Either way the waiter doesn't look
+ * at tw_expired again until timedwait_finish has synchronized with us
+ * through timer_cancel.
+ */
+static
+void
+timedwait_expire(void *data)
+{
+	struct timedwait *tw = data;
+	bool asleep;
+
+	wchan_lock(tw->tw_wchan);
+	asleep = tw->tw_asleep;
+	if (!asleep) {
+		tw->tw_expired = true;
+	}
+	wchan_unlock(tw->tw_wchan);
+
+	if (asleep && wchan_wakethread(tw->tw_wchan, tw->tw_thread)) {
+		tw->tw_expired = true;
+	}
+}
+
+void
+timedwait_start(struct timedwait *tw, struct wchan *wc, uint64_t usecs)
+{
+	tw->tw_thread = curthread;
+	tw->tw_wchan = wc;
+	tw->tw_asleep = false;
+	tw->tw_expired = false;
+	timer_init(&tw->tw_timer, timedwait_expire, tw);
+	timer_start(&tw->tw_timer, usecs);
+}
+
+void
+timedwait_sleep(struct timedwait *tw)
+{
+	KASSERT(tw->tw_thread == curthread);
+
+	if (tw->tw_expired) {
+		wchan_unlock(tw->tw_wchan);
+	}
+	else {
+		tw->tw_asleep = true;
+		wchan_sleep(tw->tw_wchan);
+	}
+}
+
+bool
+timedwait_finish(struct timedwait *tw)
+{
+	KASSERT(tw->tw_thread == curthread);
+
+	/* Once this returns, the callback is done with TW. */
+	timer_cancel(&tw->tw_timer);
+	return tw->tw_expired;
+}
+
+/*
+ * Sleep for USECS microseconds.
+ */
+void
+clockusleep(uint64_t usecs)
+{
+	struct timedwait tw;
+	uint64_t now, deadline;
+
+	now = nanotime();
+	deadline = now + usecs * 1000;
+	while (now < deadline) {
+		timedwait_start(&tw, timer_sleepchan, (deadline - now) / 1000);
+		wchan_lock(timer_sleepchan);
+		timedwait_sleep(&tw);
+		timedwait_finish(&tw);
+		now = nanotime();
 	}
 }
 
+////////////////////////////////////////////////////////////
+// Scheduling
+
 /*
  * This is called HZ times a second (on each processor) by the timer
  * code.
@@ -123,10 +421,7 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
-	thread_yield();
+	thread_timeslice();
 }
 
 /*
@@ -135,11 +430,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clockusleep((uint64_t)num_secs * 1000000);
+	}
 }
 
 /*
@@ -149,9 +442,7 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	if (num_ticks > 0) {
+		clockusleep((uint64_t)num_ticks * LT_GRANULARITY);
+	}
 }
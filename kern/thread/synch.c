@@ -33,12 +33,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <kmem.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,32 +150,61 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from an object cache. The wait channel and spinlock are
+ * set up once by the constructor and kept while the lock sits in the
+ * cache, so lock_create only has to copy the name.
+ */
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+
+static struct kmem_cache lock_cache =
+        KMEM_CACHE_INITIALIZER("lock", struct lock, lock_ctor, lock_dtor);
+
+static
+int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->lk_name = NULL;
+        lock->lk_wchan = wchan_create("lock");
+        if (lock->lk_wchan == NULL) {
+                return ENOMEM;
+        }
+
+        spinlock_init(&lock->lk_lock);
+        lock->lk_owner = NULL;
+        lock->lk_held = false;
+        return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+        spinlock_cleanup(&lock->lk_lock);
+        wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
-                return NULL;
-        }
-
-        lock->lk_wchan = wchan_create(lock->lk_name);
-        if (lock->lk_wchan == NULL) {
-                kfree(lock->lk_name);
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
-
-        spinlock_init(&lock->lk_lock);
-        lock->lk_owner = NULL;
-        lock->lk_held = false;
+        wchan_setname(lock->lk_wchan, lock->lk_name);
 
         return lock;
 }
@@ -181,22 +213,75 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+        KASSERT(wchan_isempty(lock->lk_wchan));
 
-        spinlock_cleanup(&lock->lk_lock);
-        wchan_destroy(lock->lk_wchan);
+        /* Put it back the way the constructor left it */
+        wchan_setname(lock->lk_wchan, "lock");
         kfree(lock->lk_name);
-        kfree(lock);
+        lock->lk_name = NULL;
+        lock->lk_owner = NULL;
+        lock->lk_held = false;
+        kmem_cache_free(&lock_cache, lock);
+}
+
+/*
+ * How many times lock_acquire checks a lock held by a running thread
+ * before it gives up and sleeps, and how often, while doing so, it
+ * makes sure the holder is still running.
+ */
+#define LOCK_MAXSPIN 1000
+#define LOCK_SPINCHECK 50
+
+/*
+ * Is the lock's owner running (on some other cpu)? Call with lk_lock
+ * held, which keeps the owner from releasing the lock, and so from
+ * exiting, while we look at it.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+        KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+        return lock->lk_owner != NULL && lock->lk_owner->t_state == S_RUN;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+        volatile struct thread *owner;
+        unsigned spins, i;
+
         KASSERT(lock != NULL);
         KASSERT(lock->lk_owner != curthread);
 
+        owner = NULL;
+        spins = 0;
         spinlock_acquire(&lock->lk_lock);
 
-        while (lock->lk_held) {
+        /* If lock_release handed the lock to us, we own it already. */
+        while (lock->lk_held && lock->lk_owner != curthread) {
+                if (lock->lk_owner != owner) {
+                        /* Someone else has it now; spin afresh */
+                        owner = lock->lk_owner;
+                        spins = 0;
+                }
+                if (spins < LOCK_MAXSPIN && lock_owner_running(lock)) {
+                        /*
+                         * Watch for the owner to let go, without the
+                         * spinlock, for LOCK_SPINCHECK turns; then
+                         * come back here to check it's still running,
+                         * and go to sleep if not.
+                         */
+                        spinlock_release(&lock->lk_lock);
+                        for (i=0; i<LOCK_SPINCHECK && lock->lk_held &&
+                                     lock->lk_owner == owner; i++) {
+                                /* spin */
+                        }
+                        spins += i;
+                        spinlock_acquire(&lock->lk_lock);
+                        continue;
+                }
+
                 wchan_lock(lock->lk_wchan);
                 spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
@@ -212,15 +297,28 @@ lock_acquire(struct lock *lock)
 void
 lock_release(struct lock *lock)
 {
+        struct thread *next;
+
         KASSERT(lock != NULL);
         KASSERT(lock->lk_held);
         KASSERT(lock->lk_owner == curthread);
 
         spinlock_acquire(&lock->lk_lock);
 
-        lock->lk_owner = NULL;
-        lock->lk_held = false;
-        wchan_wakeone(lock->lk_wchan);
+        /*
+         * If anyone is asleep waiting, the lock goes straight to the
+         * one we wake. Otherwise someone spinning, or just arriving,
+         * would usually get it before the woken thread could run, and
+         * it would only go back to sleep.
+         */
+        next = wchan_wakeone(lock->lk_wchan);
+        if (next != NULL) {
+                lock->lk_owner = next;
+        }
+        else {
+                lock->lk_owner = NULL;
+                lock->lk_held = false;
+        }
 
         spinlock_release(&lock->lk_lock);
 }
@@ -285,6 +383,27 @@ cv_wait(struct cv *cv, struct lock *lock)
         lock_acquire(lock);
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, uint64_t usecs)
+{
+        struct timedwait tw;
+        bool timedout;
+
+        KASSERT(cv != NULL);
+        KASSERT(lock != NULL);
+        KASSERT(lock_do_i_hold(lock));
+
+        /* Arm the timer first; it can't be started under a wchan lock */
+        timedwait_start(&tw, cv->cv_wchan, usecs);
+        wchan_lock(cv->cv_wchan);
+        lock_release(lock);
+        timedwait_sleep(&tw);
+        timedout = timedwait_finish(&tw);
+        lock_acquire(lock);
+
+        return timedout ? ETIMEDOUT : 0;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -40,6 +40,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <clock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -50,13 +51,18 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Most exited threads (with their stacks) each cpu keeps for reuse. */
+#define THREAD_SPARES_MAX 8
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -72,6 +78,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Where thread structures come from. */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", struct thread, NULL, NULL);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +121,42 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Initialize the fields of a thread structure for a new thread called
+ * NAME, which must be kmalloc'd and now belongs to the thread. The
+ * stack is left alone.
+ */
+static
+void
+thread_setup(struct thread *thread, char *name)
+{
+	thread->t_name = name;
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_tid = 0;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+	thread->t_pinned = false;
+	bzero(&thread->t_stats, sizeof(thread->t_stats));
+	thread->t_readysince = 0;
+	thread->t_runsince = 0;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -120,40 +166,88 @@ struct thread *
 thread_create(const char *name)
 {
 	struct thread *thread;
+	char *namecopy;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
+	namecopy = kstrdup(name);
+	if (namecopy == NULL) {
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	thread_setup(thread, namecopy);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
 
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	return thread;
+}
 
-	/* If you add to struct thread, be sure to initialize here */
+/*
+ * Get a thread, stack included, from the current cpu's spares, for a
+ * new thread called NAME. Returns NULL if there are none (or if out
+ * of memory).
+ */
+static
+struct thread *
+thread_getspare(const char *name)
+{
+	struct thread *thread;
+	char *namecopy;
+	int spl;
+
+	namecopy = kstrdup(name);
+	if (namecopy == NULL) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_spares);
+	splx(spl);
+
+	if (thread == NULL) {
+		kfree(namecopy);
+		return NULL;
+	}
+	KASSERT(thread->t_stack != NULL);
+	thread_setup(thread, namecopy);
 
 	return thread;
 }
 
+/*
+ * Keep a dead thread and its stack on the current cpu's spares, if
+ * there's room. Returns true if it was kept.
+ */
+static
+bool
+thread_putspare(struct thread *thread)
+{
+	bool kept = false;
+	int spl;
+
+	KASSERT(thread->t_stack != NULL);
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	/* An overrun stack means memory is already corrupt; stop here */
+	thread_checkstack(thread);
+
+	spl = splhigh();
+	if (curcpu->c_spares.tl_count < THREAD_SPARES_MAX) {
+		threadlistnode_init(&thread->t_listnode, thread);
+		threadlist_addtail(&curcpu->c_spares, thread);
+		kept = true;
+	}
+	splx(spl);
+
+	return kept;
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -179,20 +273,34 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_spares);
 	c->c_hardclocks = 0;
+	c->c_steals = 0;
+	bzero(&c->c_stats, sizeof(c->c_stats));
+#if OPT_A3
+	/* start.S resets the TLB before we get here */
+	c->c_tlb_nused = 0;
+	c->c_tlb_victim = 0;
+	c->c_tlb_asid = 0;
+	c->c_tlb_asidgen = 0;
+#endif /* OPT_A3 */
 
 	c->c_isidle = false;
+	c->c_stolen = 0;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	kmalloc_cpuinit(c->c_number);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -249,9 +357,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +364,17 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread->t_name = NULL;
+
+	/* Keep it for the next thread_fork if we can */
+	if (thread->t_stack != NULL && thread_putspare(thread)) {
+		return;
+	}
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -426,6 +541,33 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Put a thread on a run queue, behind every thread already there at
+ * the same or a higher priority. The run queue is thus kept sorted by
+ * level, and round-robin within each level.
+ */
+static
+void
+thread_enqueue(struct threadlist *rq, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	for (tln = rq->tl_tail.tln_prev; tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(rq, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(rq, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +592,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_readysince = nanotime();
+	thread_enqueue(&targetcpu->c_runqueue, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -465,20 +608,15 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Common part of thread_fork and thread_fork_oncpu: the new thread
+ * starts on cpu C, and is pinned there if PINNED is set.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_common(const char *name,
+		   struct proc *proc, struct cpu *c, bool pinned,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -487,16 +625,20 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if there is one */
+	newthread = thread_getspare(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -505,7 +647,8 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = c;
+	newthread->t_pinned = pinned;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -528,12 +671,179 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the target cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, curthread->t_cpu, false,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread that runs only on cpu number CPUNUM.
+ */
+int
+thread_fork_oncpu(const char *name,
+		  struct proc *proc, unsigned cpunum,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
+{
+	if (cpunum >= cpuarray_num(&allcpus)) {
+		return EINVAL;
+	}
+	return thread_fork_common(name, proc, cpuarray_get(&allcpus, cpunum),
+				  true, entrypoint, data1, data2);
+}
+
+/*
+ * Thread migration.
+ *
+ * This is done by work stealing: a cpu that runs out of things to do
+ * takes a thread from the busiest other cpu, rather than busy cpus
+ * pushing threads to idle ones. Only the idle cpu does any work, and
+ * only when it has nothing better to do.
+ *
+ * The thread is taken from the tail of the victim's run queue, which
+ * is the lowest-priority thread there and the one that would have had
+ * to wait longest. If it is the only thread waiting and it ran on the
+ * victim within the last SCHED_CACHEHOT_HARDCLOCKS, it is left where
+ * it is: its working set is probably still in the victim's cache, and
+ * it will not have to wait long there.
+ *
+ * Called from thread_switch with interrupts off and without our own
+ * run queue locked. Returns the stolen thread, which is on no list and
+ * already belongs to the current cpu, or NULL.
+ */
+#define SCHED_CACHEHOT_HARDCLOCKS	2
+
+/*
+ * Return the thread on C's run queue that may be stolen, or NULL if
+ * there is none. This is the last one that isn't pinned to C. C's run
+ * queue must be locked.
+ */
+static
+struct thread *
+thread_stealable(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t = c->c_runqueue.tl_tail.tln_prev->tln_self;
+	while (t != NULL && t->t_pinned) {
+		t = t->t_listnode.tln_prev->tln_self;
+	}
+	if (t != NULL && c->c_runqueue.tl_count == 1 &&
+	    c->c_hardclocks - t->t_lastrun < SCHED_CACHEHOT_HARDCLOCKS) {
+		return NULL;
+	}
+	return t;
+}
+
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	/* Pick a victim. The counts are read unlocked; they're a hint. */
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && !c->c_isidle &&
+		    c->c_runqueue.tl_count > most) {
+			victim = c;
+			most = c->c_runqueue.tl_count;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+
+	/*
+	 * An idle cpu with something on its run queue is in the middle
+	 * of waking up, and what's on the queue may still be its
+	 * curthread (see thread_switch). Leave it be.
+	 */
+	t = NULL;
+	if (!victim->c_isidle) {
+		t = thread_stealable(victim);
+	}
+	if (t != NULL) {
+		KASSERT(t != victim->c_curthread);
+		threadlist_remove(&victim->c_runqueue, t);
+		t->t_cpu = curcpu->c_self;
+		t->t_stats.ts_migrations++;
+		victim->c_stolen++;
+	}
+
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return NULL;
+	}
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return t;
+}
+
+/*
+ * Statistics for thread_switch: thread T is about to start running on
+ * the current cpu at time NOW. Charge the time it spent waiting on the
+ * run queue to it and to the cpu.
+ */
+static
+void
+thread_count_dispatch(struct thread *t, uint64_t now)
+{
+	struct cpustats *cs;
+	uint64_t wait, usecs;
+	unsigned b;
+
+	cs = &curcpu->c_stats;
+	cs->cs_ndispatch++;
+	t->t_runsince = now;
+
+	if (now == 0 || t->t_readysince == 0 || now < t->t_readysince) {
+		/* Early in boot; no clock yet. */
+		return;
+	}
+	wait = now - t->t_readysince;
+	t->t_stats.ts_waittime += wait;
+	cs->cs_waittime += wait;
+
+	usecs = wait / 1000;
+	for (b = 0; b < CPUSTATS_NBUCKETS - 1 && (usecs >> (b+1)) != 0; b++) {
+		/* nothing */
+	}
+	cs->cs_waithist[b]++;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -548,6 +858,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	bool tickless;
+	uint64_t now, then;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -589,6 +901,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		/*
+		 * Blocking before the quantum runs out is what
+		 * interactive threads do; move up a level for it.
+		 */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -611,9 +931,26 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastrun = curcpu->c_hardclocks;
+
+	/* Charge cur for its time on the cpu and count the switch. */
+	now = nanotime();
+	if (now != 0 && cur->t_runsince != 0) {
+		cur->t_stats.ts_runtime += now - cur->t_runsince;
+		curcpu->c_stats.cs_runtime += now - cur->t_runsince;
+	}
+	if (newstate == S_READY && cur->t_in_interrupt) {
+		cur->t_stats.ts_nivcsw++;
+		curcpu->c_stats.cs_nivcsw++;
+	}
+	else {
+		cur->t_stats.ts_nvcsw++;
+		curcpu->c_stats.cs_nvcsw++;
+	}
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -629,17 +966,50 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * While idle we don't take hardclocks, since there's nothing
+	 * for them to do; anything that gives us work to do sends an
+	 * IPI, including busy cpus with threads to spare (see
+	 * thread_timeslice). Turn the clock back on when we leave.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	tickless = false;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				if (!tickless) {
+					mainbus_hardclock_stop();
+					tickless = true;
+				}
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL) {
+				/*
+				 * Something better may have been woken
+				 * up here meanwhile; queue the stolen
+				 * thread and go round again.
+				 */
+				thread_enqueue(&curcpu->c_runqueue, next);
+				next = NULL;
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (tickless) {
+		mainbus_hardclock_start();
+	}
+
+	then = nanotime();
+	if (tickless && now != 0) {
+		curcpu->c_stats.cs_idletime += then - now;
+	}
+	thread_count_dispatch(next, then);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -802,6 +1172,13 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	DEBUG(DB_THREADS, "Thread %s exiting: %u/%u switches, "
+	      "ran %llu us, waited %llu us, %u migrations\n",
+	      cur->t_name, cur->t_stats.ts_nvcsw, cur->t_stats.ts_nivcsw,
+	      (unsigned long long)(cur->t_stats.ts_runtime / 1000),
+	      (unsigned long long)(cur->t_stats.ts_waittime / 1000),
+	      cur->t_stats.ts_migrations);
+
 	/* Interrupts off on this processor */
         splhigh();
 	thread_switch(S_ZOMBIE, NULL);
@@ -822,139 +1199,265 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a level,
+ * t_priority, from 0 (highest) to SCHED_NLEVELS-1. Run queues are kept
+ * sorted by level (see thread_enqueue), so thread_switch always picks
+ * the best thread available. The levels change as follows:
+ *
+ *    - New threads start at level 0.
+ *    - A thread that runs for SCHED_QUANTUM(level) hardclocks at its
+ *      level drops a level (thread_timeslice).
+ *    - A thread that sleeps on a wait channel rises a level
+ *      (thread_switch).
+ *    - Every SCHED_BOOST_HARDCLOCKS, all threads go back to level 0,
+ *      so CPU-bound threads cannot be starved by a stream of
+ *      interactive ones (schedule).
+ *
+ * Lower levels get longer quanta, so CPU-bound threads switch less
+ * often, while threads that sleep a lot stay at the top and preempt
+ * them as soon as they wake up.
  */
+#define SCHED_NLEVELS		4
+#define SCHED_QUANTUM(level)	(1U << (level))
+/* Once a second. schedule() only runs every SCHEDULE_HARDCLOCKS, so
+   this must be a multiple of that. */
+#define SCHED_BOOST_HARDCLOCKS	HZ
 
+/*
+ * This is called periodically from hardclock(). It does the periodic
+ * boost for the current CPU.
+ */
 void
 schedule(void)
 {
+	struct threadlistnode *tln;
+
+	if ((curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS) != 0) {
+		return;
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Moving every queued thread to level 0 leaves the queue
+	 * sorted, so no reordering is needed.
 	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (tln = curcpu->c_runqueue.tl_head.tln_next; tln->tln_self != NULL;
+	     tln = tln->tln_next) {
+		tln->tln_self->t_priority = 0;
+		tln->tln_self->t_ticks = 0;
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Send an idle cpu, if there is one, off to look for work. Idle cpus
+ * take no hardclocks, so they only go looking when poked.
  */
+static
 void
-thread_consider_migration(void)
+thread_wake_thief(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned i, numcpus;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		/* Unlocked read; at worst we send a useless IPI. */
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Called from hardclock() on every tick. The tick is charged to the
+ * current thread, which drops a level if that uses up its quantum.
+ * It then gives way to the head of the run queue if that thread is at
+ * a higher level, or at the same level once the quantum is up.
+ *
+ * If nothing else is waiting to run there is no switch at all, and
+ * the run queue isn't even locked. If something is, and an idle cpu
+ * would be allowed to steal it (see thread_steal), one is woken to
+ * come and do so.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur, *next;
+	bool expired, preempt, stealable;
+
+	/* Nothing to charge if the timer interrupted the idle loop. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	expired = cur->t_ticks >= SCHED_QUANTUM(cur->t_priority);
+	if (expired) {
+		cur->t_ticks = 0;
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	/* Unlocked peek; anything added meanwhile waits a tick. */
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = next != NULL &&
+		(next->t_priority < cur->t_priority ||
+		 (expired && next->t_priority == cur->t_priority));
+	stealable = thread_stealable(curcpu->c_self) != NULL;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	if (stealable) {
+		thread_wake_thief();
+	}
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Scheduler statistics.
+ *
+ * The per-cpu numbers are read without locking and so may be slightly
+ * inconsistent with one another on a busy system. Threads can only be
+ * found while they are running or on a run queue, so those are the
+ * only ones listed; other threads report their totals under DB_THREADS
+ * when they exit. Each cpu's threads are copied out with its run queue
+ * locked and printed afterwards, so the cpu is not held up while we
+ * talk to the console.
+ */
+#define THREADSTATS_MAX 64
+
+struct threadsnap {
+	char tsn_name[16];
+	unsigned tsn_cpu;
+	unsigned tsn_priority;
+	bool tsn_running;
+	struct threadstats tsn_stats;
+};
+
+static
+void
+thread_snap(struct threadsnap *tsn, struct thread *t, bool running)
+{
+	snprintf(tsn->tsn_name, sizeof(tsn->tsn_name), "%s", t->t_name);
+	tsn->tsn_cpu = t->t_cpu->c_number;
+	tsn->tsn_priority = t->t_priority;
+	tsn->tsn_running = running;
+	tsn->tsn_stats = t->t_stats;
+}
+
+void
+thread_printstats(void)
+{
+	struct threadsnap *snap;
+	struct cpustats *cs;
+	struct threadlistnode *tln;
+	struct cpu *c;
+	char label[32];
+	unsigned i, b, maxb, nsnap, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+
+	kprintf("cpu vcsw     ivcsw    dispatch run ms    idle ms   "
+		"wait ms   steals stolen\n");
+	maxb = 0;
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
+		cs = &c->c_stats;
+		kprintf("%-3u %-8u %-8u %-8u %-9llu %-9llu %-9llu %-6u %u\n",
+			c->c_number, cs->cs_nvcsw, cs->cs_nivcsw,
+			cs->cs_ndispatch,
+			(unsigned long long)(cs->cs_runtime / 1000000),
+			(unsigned long long)(cs->cs_idletime / 1000000),
+			(unsigned long long)(cs->cs_waittime / 1000000),
+			c->c_steals, c->c_stolen);
+		for (b=0; b<CPUSTATS_NBUCKETS; b++) {
+			if (cs->cs_waithist[b] != 0 && b > maxb) {
+				maxb = b;
 			}
+		}
+	}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+	kprintf("\nRun queue wait before dispatch:\n");
+	kprintf("%-16s", "");
+	for (i=0; i<numcpus; i++) {
+		snprintf(label, sizeof(label), "cpu%u", i);
+		kprintf(" %8s", label);
+	}
+	kprintf("\n");
+	for (b=0; b<=maxb; b++) {
+		if (b == 0) {
+			snprintf(label, sizeof(label), "< 2 us");
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		else if (b == CPUSTATS_NBUCKETS - 1) {
+			snprintf(label, sizeof(label), ">= %u us", 1U << b);
+		}
+		else {
+			snprintf(label, sizeof(label), "%u-%u us",
+				 1U << b, (1U << (b+1)) - 1);
+		}
+		kprintf("%-16s", label);
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			kprintf(" %8u", c->c_stats.cs_waithist[b]);
+		}
+		kprintf("\n");
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	snap = kmalloc(THREADSTATS_MAX * sizeof(*snap));
+	if (snap == NULL) {
+		kprintf("\nOut of memory listing threads\n");
+		return;
+	}
+	nsnap = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (!c->c_isidle && nsnap < THREADSTATS_MAX) {
+			thread_snap(&snap[nsnap++], c->c_curthread, true);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		for (tln = c->c_runqueue.tl_head.tln_next;
+		     tln->tln_self != NULL && nsnap < THREADSTATS_MAX;
+		     tln = tln->tln_next) {
+			thread_snap(&snap[nsnap++], tln->tln_self, false);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	kprintf("\nThread           cpu lvl state vcsw     ivcsw    "
+		"migr   run ms    wait ms\n");
+	for (i=0; i<nsnap; i++) {
+		kprintf("%-16s %-3u %-3u %-5s %-8u %-8u %-6u %-9llu %llu\n",
+			snap[i].tsn_name, snap[i].tsn_cpu,
+			snap[i].tsn_priority,
+			snap[i].tsn_running ? "run" : "ready",
+			snap[i].tsn_stats.ts_nvcsw,
+			snap[i].tsn_stats.ts_nivcsw,
+			snap[i].tsn_stats.ts_migrations,
+			(unsigned long long)
+			(snap[i].tsn_stats.ts_runtime / 1000000),
+			(unsigned long long)
+			(snap[i].tsn_stats.ts_waittime / 1000000));
+	}
+	if (nsnap == THREADSTATS_MAX) {
+		kprintf("(list truncated)\n");
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kfree(snap);
 }
 
 ////////////////////////////////////////////////////////////
@@ -986,6 +1489,15 @@ wchan_create(const char *name)
 	return wc;
 }
 
+/*
+ * Change the name of a wait channel.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -1029,9 +1541,9 @@ wchan_sleep(struct wchan *wc)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * Wake up one thread sleeping on a wait channel, and return it.
  */
-void
+struct thread *
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
@@ -1047,10 +1559,11 @@ wchan_wakeone(struct wchan *wc)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1090,6 +1603,33 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up a particular thread, if it's sleeping on a wait channel.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *target)
+{
+	struct threadlistnode *tln;
+
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_self != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == target) {
+			break;
+		}
+	}
+	if (tln->tln_self == NULL) {
+		/* Not here; someone else woke it already. */
+		spinlock_release(&wc->wc_lock);
+		return false;
+	}
+	threadlist_remove(&wc->wc_threads, target);
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+	return true;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1140,21 +1680,38 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Add MAPPING to TARGET's shootdown queue, or give up and flush the
+ * whole TLB if the queue is full.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_queue_shootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* Already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+
+	ipi_queue_shootdown(target, mapping);
+	target->c_shootdown_seq++;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1162,6 +1719,73 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_batch(uint32_t cpus, const struct tlbshootdown *mappings,
+		       unsigned n)
+{
+	unsigned ticket[32];
+	unsigned i, j, numcpus, sent, done;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	numcpus = cpuarray_num(&allcpus);
+	KASSERT(numcpus <= 32);
+
+	sent = 0;
+	for (i=0; i<numcpus; i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+
+		/* Stay on this cpu while checking whether it's C */
+		spl = splhigh();
+		if (c == curcpu->c_self) {
+			for (j=0; j<n; j++) {
+				vm_tlbshootdown(&mappings[j]);
+			}
+			splx(spl);
+			cpus &= ~((uint32_t)1 << i);
+			continue;
+		}
+		splx(spl);
+
+		spinlock_acquire(&c->c_ipi_lock);
+		for (j=0; j<n; j++) {
+			ipi_queue_shootdown(c, &mappings[j]);
+		}
+		ticket[i] = ++c->c_shootdown_seq;
+		/* If an IPI is already on its way, it will do these too */
+		if ((c->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN))
+		    == 0) {
+			c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+			mainbus_send_ipi(c);
+			sent++;
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
+
+	/*
+	 * Wait with interrupts on (between tries), so that other cpus
+	 * waiting for us to do their shootdowns don't deadlock with us.
+	 */
+	for (i=0; i<numcpus; i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			done = c->c_shootdown_done;
+			spinlock_release(&c->c_ipi_lock);
+		} while ((int)(done - ticket[i]) < 0);
+	}
+
+	return sent;
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1202,6 +1826,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
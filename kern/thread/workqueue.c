@@ -0,0 +1,352 @@
+/*
+ * Kernel work queues. See workqueue.h for the interface.
+ *
+ * Each queue is a FIFO list protected by a spinlock, so work can be
+ * queued from anywhere, including the timer callback that queues
+ * delayed work. Idle workers sleep on the queue's wait channel; each
+ * item queued wakes one of them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <workqueue.h>
+
+#define WQ_MAXCPUS	32	/* queues, at most */
+#define WQ_NWORKERS	2	/* worker threads per queue */
+
+struct workqueue {
+	struct spinlock wq_lock;
+	struct work *wq_head;		/* next to run */
+	struct work *wq_tail;		/* last queued */
+	struct wchan *wq_wchan;		/* idle workers sleep here */
+	unsigned wq_num;
+
+	/* For workqueue_flush; protected by wq_lock. */
+	struct thread *wq_workers[WQ_NWORKERS];
+	unsigned wq_nworkers;
+	unsigned wq_ndone;		/* items whose function has returned */
+	unsigned wq_nflushers;		/* threads on wq_flushwchan */
+	struct wchan *wq_flushwchan;	/* workqueue_flush waits here */
+
+	/* Statistics; protected by wq_lock. Times in nanoseconds. */
+	unsigned wq_depth;		/* items on the queue now */
+	unsigned wq_maxdepth;		/* most items ever on the queue */
+	unsigned wq_nqueued;		/* items queued */
+	unsigned wq_nrun;		/* items taken off by workers */
+	uint64_t wq_latency;		/* total time from queued to run */
+	uint64_t wq_maxlatency;		/* longest time from queued to run */
+};
+
+static struct workqueue workqueues[WQ_MAXCPUS];
+static unsigned nworkqueues;
+
+/* For work_defer */
+struct deferral {
+	struct work d_work;
+	void (*d_func)(void *);
+	void *d_data;
+};
+
+/*
+ * The queue for the current cpu. We may be moved to another cpu right
+ * after looking, but that only costs some locality.
+ */
+static
+struct workqueue *
+workqueue_mine(void)
+{
+	KASSERT(nworkqueues > 0);
+	return &workqueues[curcpu->c_number % nworkqueues];
+}
+
+/*
+ * Put W on WQ and wake a worker.
+ */
+static
+void
+workqueue_add(struct workqueue *wq, struct work *w)
+{
+	spinlock_acquire(&wq->wq_lock);
+	w->w_next = NULL;
+	w->w_queuetime = nanotime();
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = w;
+	}
+	else {
+		wq->wq_tail->w_next = w;
+	}
+	wq->wq_tail = w;
+	wq->wq_nqueued++;
+	wq->wq_depth++;
+	if (wq->wq_depth > wq->wq_maxdepth) {
+		wq->wq_maxdepth = wq->wq_depth;
+	}
+	spinlock_release(&wq->wq_lock);
+
+	wchan_wakeone(wq->wq_wchan);
+}
+
+/*
+ * Timer callback for work_queue_delayed.
+ */
+static
+void
+work_timeout(void *data)
+{
+	struct work *w = data;
+
+	KASSERT(w->w_pending && w->w_delayed);
+	KASSERT(w->w_wq != NULL);
+
+	/* Its time has come; w_wq was set by work_queue_delayed. */
+	w->w_delayed = false;
+	workqueue_add(w->w_wq, w);
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *data)
+{
+	w->w_next = NULL;
+	w->w_func = func;
+	w->w_data = data;
+	w->w_wq = NULL;
+	w->w_queuetime = 0;
+	timer_init(&w->w_timer, work_timeout, w);
+	w->w_pending = false;
+	w->w_delayed = false;
+}
+
+void
+work_queue(struct work *w)
+{
+	KASSERT(!w->w_pending);
+
+	w->w_pending = true;
+	w->w_wq = workqueue_mine();
+	workqueue_add(w->w_wq, w);
+}
+
+void
+work_queue_delayed(struct work *w, uint64_t usecs)
+{
+	KASSERT(!w->w_pending);
+
+	w->w_pending = true;
+	w->w_delayed = true;
+	w->w_wq = workqueue_mine();
+	timer_start(&w->w_timer, usecs);
+}
+
+static
+void
+work_deferred(void *data)
+{
+	struct deferral *d = data;
+
+	d->d_func(d->d_data);
+	kfree(d);
+}
+
+int
+work_defer(void (*func)(void *), void *data)
+{
+	struct deferral *d;
+
+	d = kmalloc(sizeof(*d));
+	if (d == NULL) {
+		return ENOMEM;
+	}
+	d->d_func = func;
+	d->d_data = data;
+	work_init(&d->d_work, work_deferred, d);
+	work_queue(&d->d_work);
+	return 0;
+}
+
+/*
+ * Worker thread: run whatever turns up on the queue, forever.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long data2)
+{
+	struct workqueue *wq = data1;
+	struct work *w;
+	uint64_t latency;
+	bool wake;
+
+	(void)data2;
+
+	/* So workqueue_flush can tell it is being called from a worker */
+	spinlock_acquire(&wq->wq_lock);
+	KASSERT(wq->wq_nworkers < WQ_NWORKERS);
+	wq->wq_workers[wq->wq_nworkers++] = curthread;
+	spinlock_release(&wq->wq_lock);
+
+	while (1) {
+		spinlock_acquire(&wq->wq_lock);
+		while (wq->wq_head == NULL) {
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&wq->wq_lock);
+		}
+
+		w = wq->wq_head;
+		wq->wq_head = w->w_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		w->w_next = NULL;
+		w->w_pending = false;
+
+		KASSERT(wq->wq_depth > 0);
+		wq->wq_depth--;
+		wq->wq_nrun++;
+		latency = nanotime() - w->w_queuetime;
+		wq->wq_latency += latency;
+		if (latency > wq->wq_maxlatency) {
+			wq->wq_maxlatency = latency;
+		}
+		spinlock_release(&wq->wq_lock);
+
+		w->w_func(w->w_data);
+
+		spinlock_acquire(&wq->wq_lock);
+		wq->wq_ndone++;
+		wake = wq->wq_nflushers > 0;
+		spinlock_release(&wq->wq_lock);
+		if (wake) {
+			wchan_wakeall(wq->wq_flushwchan);
+		}
+	}
+}
+
+/*
+ * Wait for the work on WQ that was queued before the call to finish.
+ * Call with wq_lock held; returns with it held.
+ */
+static
+void
+workqueue_flushone(struct workqueue *wq)
+{
+	unsigned target;
+
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+
+	target = wq->wq_nqueued;
+	/* Compare the difference, as the counts may wrap. */
+	while ((int)(wq->wq_ndone - target) < 0) {
+		wq->wq_nflushers++;
+		wchan_lock(wq->wq_flushwchan);
+		spinlock_release(&wq->wq_lock);
+		wchan_sleep(wq->wq_flushwchan);
+		spinlock_acquire(&wq->wq_lock);
+		wq->wq_nflushers--;
+	}
+}
+
+bool
+workqueue_flush(void)
+{
+	struct workqueue *wq;
+	unsigned i;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	/*
+	 * A worker would be waiting for itself. Workers never leave
+	 * their own cpu, so only this cpu's queue needs checking.
+	 */
+	wq = workqueue_mine();
+	spinlock_acquire(&wq->wq_lock);
+	for (i=0; i<wq->wq_nworkers; i++) {
+		if (wq->wq_workers[i] == curthread) {
+			spinlock_release(&wq->wq_lock);
+			return false;
+		}
+	}
+	spinlock_release(&wq->wq_lock);
+
+	for (i=0; i<nworkqueues; i++) {
+		wq = &workqueues[i];
+		spinlock_acquire(&wq->wq_lock);
+		workqueue_flushone(wq);
+		spinlock_release(&wq->wq_lock);
+	}
+	return true;
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct workqueue *wq;
+	char name[16];
+	unsigned i, j;
+	int result;
+
+	nworkqueues = cpu_numcpus();
+	if (nworkqueues > WQ_MAXCPUS) {
+		nworkqueues = WQ_MAXCPUS;
+	}
+
+	for (i=0; i<nworkqueues; i++) {
+		wq = &workqueues[i];
+		spinlock_init(&wq->wq_lock);
+		wq->wq_head = wq->wq_tail = NULL;
+		wq->wq_wchan = wchan_create("workqueue");
+		wq->wq_flushwchan = wchan_create("workqueue flush");
+		if (wq->wq_wchan == NULL || wq->wq_flushwchan == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+		wq->wq_num = i;
+		wq->wq_nworkers = 0;
+		wq->wq_ndone = 0;
+		wq->wq_nflushers = 0;
+	}
+
+	for (i=0; i<nworkqueues; i++) {
+		for (j=0; j<WQ_NWORKERS; j++) {
+			snprintf(name, sizeof(name), "worker%u/%u", i, j);
+			/* Pinned to its queue's cpu, so work stays local */
+			result = thread_fork_oncpu(name, NULL, i,
+						   workqueue_worker,
+						   &workqueues[i], 0);
+			if (result) {
+				panic("workqueue_bootstrap: thread_fork_oncpu: "
+				      "%s\n",
+				      strerror(result));
+			}
+		}
+	}
+}
+
+void
+workqueue_printstats(void)
+{
+	struct workqueue snap;
+	unsigned i;
+
+	kprintf("queue depth max   queued   run      "
+		"avg wait us  max wait us\n");
+	for (i=0; i<nworkqueues; i++) {
+		/* Copy it out; don't print with the queue locked. */
+		spinlock_acquire(&workqueues[i].wq_lock);
+		snap = workqueues[i];
+		spinlock_release(&workqueues[i].wq_lock);
+
+		kprintf("%-5u %-5u %-5u %-8u %-8u %-12llu %llu\n",
+			snap.wq_num, snap.wq_depth, snap.wq_maxdepth,
+			snap.wq_nqueued, snap.wq_nrun,
+			(unsigned long long)(snap.wq_nrun == 0 ? 0 :
+				snap.wq_latency / snap.wq_nrun / 1000),
+			(unsigned long long)(snap.wq_maxlatency / 1000));
+	}
+}
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <workqueue.h>
 
 /*
  * Structure for a single named device.
@@ -169,6 +170,33 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Periodic writeback: sync everything every VFS_WRITEBACK_SECS
+ * seconds from a work queue, so dirty buffers don't sit in memory
+ * until someone happens to call sync.
+ */
+#define VFS_WRITEBACK_SECS 30
+
+static struct work vfs_writeback_work;
+
+static
+void
+vfs_writeback(void *data)
+{
+	struct work *w = data;
+
+	vfs_sync();
+	work_queue_delayed(w, (uint64_t)VFS_WRITEBACK_SECS * 1000000);
+}
+
+void
+vfs_writeback_start(void)
+{
+	work_init(&vfs_writeback_work, vfs_writeback, &vfs_writeback_work);
+	work_queue_delayed(&vfs_writeback_work,
+			   (uint64_t)VFS_WRITEBACK_SECS * 1000000);
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -30,7 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem.h>
+#include "opt-A3.h"
+#include "opt-kmprof.h"
 
 /*
  * Kernel malloc.
@@ -70,6 +76,16 @@ fill_deadbeef(void *vptr, size_t len)
 //    more blocks would fit on a page than with the existing block
 //    sizes, and large numbers of items of the new size are allocated.
 //
+//    Most sizes use single pages. A few sizes that pack badly into a
+//    page (1536 would leave a third of it unused) use "pages" made of
+//    several physically contiguous pages instead; everything below
+//    that says "page" means one of these.
+//
+//    When a page has no blocks in use it is handed straight back to
+//    the page allocator. To give pages a chance to empty out after a
+//    burst of allocation, new blocks are taken from the fullest page
+//    that has any free.
+//
 //    The free counts and addresses of the pages are maintained in
 //    another list.  Maintaining this table is a nuisance, because it
 //    cannot recursively use the subpage allocator. (We could probably
@@ -83,11 +99,19 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NSIZES 15
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+	3072
+};
+/* Number of pages in each size's "page"; chosen to waste nothing */
+static const unsigned slabpages[NSIZES] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 1, 3
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 3072
+#define MAX_SLABPAGES 3
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -102,7 +126,8 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
+	struct pageref *next_partial;	/* in its nfree bucket */
+	struct pageref **pprev_partial;	/* what points to us there */
 	struct pageref *next_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
@@ -115,89 +140,282 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Bytes in a page of blocks of type BLK, and the blocks in it */
+#define SLABSIZE(blk)    (slabpages[blk] * PAGE_SIZE)
+#define SLABBLOCKS(blk)  (SLABSIZE(blk) / sizes[blk])
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs are carved out of whole pages, which we get from
+ * alloc_kpages as the heap grows. Free ones are kept on a list linked
+ * through next_all. We never give the pages back; a pageref is small
+ * next to the page it describes.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freepagerefs;
+static unsigned npagerefs;	/* total, free or not */
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	pr = freepagerefs;
+	if (pr != NULL) {
+		freepagerefs = pr->next_all;
 	}
-
-	/* ran out */
-	return NULL;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->next_all = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
 
-static struct pageref *sizebases[NSIZES];
+/*
+ * Pages with some blocks free and some in use are kept in buckets by
+ * how many are free: bucket b holds those with between 2^b and
+ * 2^(b+1)-1 free blocks. Allocating from the lowest nonempty bucket
+ * takes from a page that is close to the fullest, without a search,
+ * so the emptier pages get a chance to drain and be released. Full
+ * pages are on no bucket; every page is on allbase.
+ */
+#define NBUCKETS 9	/* enough for SLABBLOCKS(0) == 256 */
+
+static struct pageref *partialbases[NSIZES][NBUCKETS];
 static struct pageref *allbase;
 
+static
+unsigned
+nfree_bucket(unsigned nfree)
+{
+	unsigned b = 0;
+
+	KASSERT(nfree > 0);
+	while (nfree > 1) {
+		nfree >>= 1;
+		b++;
+	}
+	KASSERT(b < NBUCKETS);
+	return b;
+}
+
+/*
+ * Put PR, which has a free block, in its bucket.
+ */
+static
+void
+partial_insert(struct pageref *pr)
+{
+	struct pageref **head;
+
+	head = &partialbases[PR_BLOCKTYPE(pr)][nfree_bucket(pr->nfree)];
+	pr->next_partial = *head;
+	if (*head != NULL) {
+		(*head)->pprev_partial = &pr->next_partial;
+	}
+	pr->pprev_partial = head;
+	*head = pr;
+}
+
+/*
+ * Take PR out of whichever bucket it is in.
+ */
+static
+void
+partial_remove(struct pageref *pr)
+{
+	KASSERT(pr->pprev_partial != NULL);
+	KASSERT(*pr->pprev_partial == pr);
+
+	*pr->pprev_partial = pr->next_partial;
+	if (pr->next_partial != NULL) {
+		pr->next_partial->pprev_partial = pr->pprev_partial;
+	}
+	pr->next_partial = NULL;
+	pr->pprev_partial = NULL;
+}
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. Most allocations and frees
+ * are satisfied from the per-cpu magazines below and never get here;
+ * the ones that do move blocks in batches, so the lock is taken once
+ * per batch rather than once per block.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Get another page of pagerefs. Must be called without
+ * kmalloc_spinlock, since we may need to call alloc_kpages.
+ * Returns false if out of memory.
+ */
+static
+bool
+morepagerefs(void)
+{
+	struct pageref *prs;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return false;
+	}
+	prs = (struct pageref *)page;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		freepageref(&prs[i]);
+	}
+	npagerefs += PAGEREFS_PER_PAGE;
+	spinlock_release(&kmalloc_spinlock);
+
+	return true;
+}
+
 ////////////////////////////////////////
+//
+// Page lookup table.
+//
+//    Maps the address of each subpage page to its pageref, so that
+//    freeing a block finds its page, and so its size class, in
+//    constant time however big the heap is. It is a two-level table
+//    over KSEG0, like the user page tables; the second-level tables
+//    are whole pages and are never released.
+//
+//    Entries are written with kmalloc_spinlock held but may be read
+//    without it, as long as the reader holds a block on the page in
+//    question: the page, and so its pageref, cannot go away until
+//    that block is freed.
+//
+
+#define KPT_L2SIZE (PAGE_SIZE / sizeof(struct pageref *))
+#define KPT_L1SIZE ((MIPS_KSEG1 - MIPS_KSEG0) / (KPT_L2SIZE * PAGE_SIZE))
+#define KPT_L1INDEX(va) (((va) - MIPS_KSEG0) / (KPT_L2SIZE * PAGE_SIZE))
+#define KPT_L2INDEX(va) ((((va) - MIPS_KSEG0) / PAGE_SIZE) % KPT_L2SIZE)
+
+static struct pageref **kpagetable[KPT_L1SIZE];
+
+/*
+ * Return the table slot for the page holding VA, or NULL if there is
+ * none. If CREATE is set, allocate a missing second-level table; this
+ * may call alloc_kpages, so kmalloc_spinlock must not be held.
+ */
+static
+struct pageref **
+kpage_lookup(vaddr_t va, bool create)
+{
+	struct pageref **l2;
+	vaddr_t l2page;
+	unsigned i;
+
+	if (va < MIPS_KSEG0 || va >= MIPS_KSEG1) {
+		return NULL;
+	}
+
+	l2 = kpagetable[KPT_L1INDEX(va)];
+	if (l2 == NULL && create) {
+		l2page = alloc_kpages(1);
+		if (l2page == 0) {
+			return NULL;
+		}
+		l2 = (struct pageref **)l2page;
+		for (i=0; i<KPT_L2SIZE; i++) {
+			l2[i] = NULL;
+		}
+
+		spinlock_acquire(&kmalloc_spinlock);
+		if (kpagetable[KPT_L1INDEX(va)] == NULL) {
+			kpagetable[KPT_L1INDEX(va)] = l2;
+			l2page = 0;
+		}
+		l2 = kpagetable[KPT_L1INDEX(va)];
+		spinlock_release(&kmalloc_spinlock);
+
+		if (l2page != 0) {
+			/* Someone else got there first. */
+			free_kpages(l2page);
+		}
+	}
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return &l2[KPT_L2INDEX(va)];
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a small stack of free blocks
+//    (a "magazine"). kmalloc pops from it and kfree pushes onto it with
+//    interrupts off and no lock held. Only when the magazine is empty
+//    on allocation, or full on free, do we go to the shared allocator,
+//    and then we move half a magazine's worth of blocks at once. A
+//    magazine that has just been refilled or drained is half full, so
+//    alternating kmalloc and kfree never bounces off the shared lists.
+//
+//    Magazines for the large sizes hold fewer blocks, so that each cpu
+//    holds back at most half a page per size class.
+//
+//    Only its own cpu ever touches a magazine. To get another cpu to
+//    empty its magazines we set kc_trim, and it does so the next time
+//    it goes to them.
+//
+
+#define KMCACHE_MAXCPUS 32
+#define KMAG_MAXROUNDS  16
+
+struct kmag {
+	unsigned km_rounds;		/* blocks currently held */
+	unsigned km_capacity;		/* most blocks we will hold */
+	void *km_blocks[KMAG_MAXROUNDS];
+};
+
+struct kmcache {
+	struct kmag kc_mags[NSIZES];
+	unsigned kc_allochits[NSIZES];
+	unsigned kc_allocmisses[NSIZES];
+	unsigned kc_freehits[NSIZES];
+	unsigned kc_freemisses[NSIZES];
+	volatile bool kc_trim;		/* empty the magazines, please */
+};
+
+/* Indexed by cpu number; written once per cpu at cpu_create time. */
+static struct kmcache *kmcaches[KMCACHE_MAXCPUS];
+
+/*
+ * Get the current cpu's magazines. Must be called with interrupts off
+ * so we stay on the cpu. Returns NULL early in boot, before curcpu is
+ * set, and on cpus that have none.
+ */
+static
+struct kmcache *
+kmcache_mine(void)
+{
+	unsigned num;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	num = curcpu->c_number;
+	if (num >= KMCACHE_MAXCPUS) {
+		return NULL;
+	}
+	return kmcaches[num];
+}
 
 /* SLOWER implies SLOW */
 #ifdef SLOWER
@@ -226,7 +444,7 @@ checksubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < SLABSIZE(blktype));
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -234,7 +452,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + SLABSIZE(blktype));
 		KASSERT((fla-prpage) % sizes[blktype] == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
@@ -252,26 +470,35 @@ void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	int i, b;
+	unsigned sc=0, ac=0, fc=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
-			sc++;
+		for (b=0; b<NBUCKETS; b++) {
+			for (pr = partialbases[i][b]; pr != NULL;
+			     pr = pr->next_partial) {
+				checksubpage(pr);
+				KASSERT(PR_BLOCKTYPE(pr) == (unsigned)i);
+				KASSERT(nfree_bucket(pr->nfree) == (unsigned)b);
+				KASSERT(sc < npagerefs);
+				sc++;
+			}
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
+		if (pr->nfree == 0) {
+			KASSERT(pr->pprev_partial == NULL);
+			fc++;
+		}
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc+fc==ac);
 }
 #else
 #define checksubpages() 
@@ -301,7 +528,7 @@ dumpsubpage(struct pageref *pr)
 	blktype = PR_BLOCKTYPE(pr);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = SLABBLOCKS(blktype);
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -334,10 +561,39 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmcache *kc;
+	unsigned i, j;
+	unsigned held, ahit, amiss, fhit, fmiss;
+#if OPT_A3
+	unsigned nused, nfree;
+
+	coremap_getstats(&nused, &nfree);
+	kprintf("Physical pages: %u used, %u free\n", nused, nfree);
+#endif /* OPT_A3 */
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
+	kprintf("Per-cpu magazines:\n");
+	for (i=0; i<NSIZES; i++) {
+		held = ahit = amiss = fhit = fmiss = 0;
+		for (j=0; j<KMCACHE_MAXCPUS; j++) {
+			kc = kmcaches[j];
+			if (kc == NULL) {
+				continue;
+			}
+			held += kc->kc_mags[i].km_rounds;
+			ahit += kc->kc_allochits[i];
+			amiss += kc->kc_allocmisses[i];
+			fhit += kc->kc_freehits[i];
+			fmiss += kc->kc_freemisses[i];
+		}
+		kprintf("   size %-4lu  %3u held  alloc %u hit %u miss  "
+			"free %u hit %u miss\n", (unsigned long) sizes[i],
+			held, ahit, amiss, fhit, fmiss);
+	}
+
+	/* blocks held in magazines show up here as in use */
 	kprintf("Subpage allocator status:\n");
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
@@ -345,6 +601,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_printstats();
 }
 
 ////////////////////////////////////////
@@ -357,13 +615,7 @@ remove_lists(struct pageref *pr, int blktype)
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
-	}
+	partial_remove(pr);
 
 	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
 		checksubpage(*guy);
@@ -392,64 +644,124 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Point the page table entries for every page of PR at VAL. The
+ * second-level tables must already exist.
+ */
+static
+void
+kpage_setslab(struct pageref *pr, struct pageref *val)
+{
+	struct pageref **slot;
+	vaddr_t va;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	va = PR_PAGEADDR(pr);
+	for (i=0; i<slabpages[PR_BLOCKTYPE(pr)]; i++) {
+		slot = kpage_lookup(va + i*PAGE_SIZE, false);
+		KASSERT(slot != NULL);
+		KASSERT(*slot == (val == NULL ? pr : NULL));
+		*slot = val;
+	}
+}
+
+/*
+ * Take one block off the freelist of PR, which must have one.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < SLABSIZE(PR_BLOCKTYPE(pr)));
 
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < SLABSIZE(PR_BLOCKTYPE(pr)));
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-	checksubpages();
+	return retptr;
+}
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+/*
+ * Allocate up to NBLOCKS blocks of size class BLKTYPE into BLOCKS[].
+ * Returns the number allocated; this is 0 only if we are out of
+ * memory. A fresh page is made only if no existing page has a free
+ * block, so a batch may come up short.
+ */
+static
+unsigned
+subpage_kmalloc(unsigned blktype, void **blocks, unsigned nblocks)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	unsigned b;		// nfree bucket we're looking in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	unsigned n = 0;		// blocks allocated so far
+	unsigned npages;	// pages in a page of this size
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	volatile int i;
 
-		if (pr->nfree > 0) {
+	KASSERT(nblocks > 0);
+	npages = slabpages[blktype];
 
-		doalloc: /* comes here after getting a whole fresh page */
+	spinlock_acquire(&kmalloc_spinlock);
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	checksubpages();
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	/*
+	 * Take from the page with the fewest free blocks, near enough:
+	 * the first one in the lowest nonempty bucket. The page comes
+	 * out of its bucket while we take from it and goes back in
+	 * whichever one it then belongs to, unless it is now full.
+	 */
+	for (b = 0; b < NBUCKETS && n < nblocks; b++) {
+		while (partialbases[blktype][b] != NULL && n < nblocks) {
+			pr = partialbases[blktype][b];
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
+			/* check for corruption */
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
+
+			partial_remove(pr);
+			while (pr->nfree > 0 && n < nblocks) {
+				blocks[n++] = subpage_takeblock(pr);
 			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+			if (pr->nfree > 0) {
+				partial_insert(pr);
 			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
 
+	if (n > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return n;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -460,25 +772,38 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = alloc_kpages(npages);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
+	}
+	for (i=0; i<(int)npages; i++) {
+		if (kpage_lookup(prpage + i*PAGE_SIZE, true) == NULL) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get a "
+				"page table\n");
+			return 0;
+		}
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while (pr==NULL) {
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		if (!morepagerefs()) {
+			/* Couldn't allocate accounting space for the page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n"); 
+			return 0;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = allocpageref();
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = SLABBLOCKS(blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,110 +823,641 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	pr->next_partial = NULL;
+	pr->pprev_partial = NULL;
 
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	kpage_setslab(pr, pr);
+
+	while (pr->nfree > 0 && n < nblocks) {
+		blocks[n++] = subpage_takeblock(pr);
+	}
+	if (pr->nfree > 0) {
+		partial_insert(pr);
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return n;
 }
 
+/*
+ * Return NBLOCKS blocks to their pages' freelists. The blocks have
+ * already been checked and filled with 0xdeadbeef by kfree.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_kfree(void **blocks, unsigned nblocks)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
+	vaddr_t ptraddr;	// address of the block being freed
+	struct pageref **slot;	// kpagetable entry for the page
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	unsigned i;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (i=0; i<nblocks; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+
+		slot = kpage_lookup(ptraddr, false);
+		KASSERT(slot != NULL && *slot != NULL);
+		pr = *slot;
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
 		/* check for corruption */
 		KASSERT(blktype>=0 && blktype<NSIZES);
+		KASSERT(ptraddr >= prpage &&
+			ptraddr < prpage + SLABSIZE(blktype));
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		offset = ptraddr - prpage;
+		KASSERT(offset % sizes[blktype] == 0);
+
+		/*
+		 * We probably ought to check for free twice by seeing if
+		 * the block is already on the free list. But that's
+		 * expensive, so we don't.
+		 */
+
+		fla = prpage + offset;
+		fl = (struct freelist *)fla;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
 		}
-	}
+		pr->freelist_offset = offset;
+		pr->nfree++;
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+		/* Move it to the bucket for its new nfree, if that changed */
+		if (pr->nfree == 1) {
+			partial_insert(pr);
+		}
+		else if (nfree_bucket(pr->nfree) !=
+			 nfree_bucket(pr->nfree - 1)) {
+			partial_remove(pr);
+			partial_insert(pr);
+		}
+
+		KASSERT(pr->nfree <= SLABBLOCKS(blktype));
+		if (pr->nfree == SLABBLOCKS(blktype)) {
+			/* Whole page is free. */
+			remove_lists(pr, blktype);
+			kpage_setslab(pr, NULL);
+			freepageref(pr);
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(prpage);
+			spinlock_acquire(&kmalloc_spinlock);
+		}
 	}
 
-	offset = ptraddr - prpage;
+	checksubpages();
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Hand everything in the current cpu's magazines back to the shared
+ * lists.
+ */
+static
+void
+kmcache_drain(void)
+{
+	struct kmcache *kc;
+	struct kmag *mag;
+	void *blocks[KMAG_MAXROUNDS];
+	unsigned i, n;
+	int spl;
+
+	for (i=0; i<NSIZES; i++) {
+		spl = splhigh();
+		kc = kmcache_mine();
+		if (kc == NULL) {
+			splx(spl);
+			return;
+		}
+		kc->kc_trim = false;
+		mag = &kc->kc_mags[i];
+		for (n=0; mag->km_rounds > 0; n++) {
+			blocks[n] = mag->km_blocks[--mag->km_rounds];
+		}
+		splx(spl);
+
+		if (n > 0) {
+			subpage_kfree(blocks, n);
+		}
 	}
+}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+/*
+ * Put NBLOCKS blocks of size class BLKTYPE into the current cpu's
+ * magazine, and hand back to the shared lists any that do not fit.
+ */
+static
+void
+kmcache_load(unsigned blktype, void **blocks, unsigned nblocks)
+{
+	struct kmcache *kc;
+	struct kmag *mag;
+	int spl;
+
+	spl = splhigh();
+	kc = kmcache_mine();
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		while (nblocks > 0 && mag->km_rounds < mag->km_capacity) {
+			mag->km_blocks[mag->km_rounds++] = blocks[--nblocks];
+		}
+	}
+	splx(spl);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	if (nblocks > 0) {
+		subpage_kfree(blocks, nblocks);
+	}
+}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+/*
+ * Allocate a block of size class BLKTYPE, from the current cpu's
+ * magazine if possible. On a miss, refill the magazine halfway.
+ */
+static
+void *
+kmcache_alloc(unsigned blktype)
+{
+	struct kmcache *kc;
+	struct kmag *mag;
+	void *blocks[KMAG_MAXROUNDS/2 + 1];
+	unsigned nwant, n;
+	int spl;
+
+	spl = splhigh();
+	kc = kmcache_mine();
+	if (kc != NULL && kc->kc_trim) {
+		splx(spl);
+		kmcache_drain();
+		spl = splhigh();
+		kc = kmcache_mine();
+	}
+	if (kc == NULL) {
+		nwant = 1;
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		mag = &kc->kc_mags[blktype];
+		if (mag->km_rounds > 0) {
+			kc->kc_allochits[blktype]++;
+			blocks[0] = mag->km_blocks[--mag->km_rounds];
+			splx(spl);
+			return blocks[0];
+		}
+		kc->kc_allocmisses[blktype]++;
+		nwant = mag->km_capacity/2 + 1;
 	}
+	splx(spl);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	n = subpage_kmalloc(blktype, blocks, nwant);
+	if (n == 0) {
+		return NULL;
+	}
+	if (n > 1) {
+		kmcache_load(blktype, blocks + 1, n - 1);
+	}
+	return blocks[0];
+}
 
-	return 0;
+/*
+ * Free a block of size class BLKTYPE into the current cpu's magazine.
+ * If the magazine is full, drain half of it to the shared lists.
+ */
+static
+void
+kmcache_free(unsigned blktype, void *ptr)
+{
+	struct kmcache *kc;
+	struct kmag *mag;
+	void *blocks[KMAG_MAXROUNDS/2 + 1];
+	unsigned n = 0;
+	int spl;
+
+	spl = splhigh();
+	kc = kmcache_mine();
+	if (kc != NULL && kc->kc_trim) {
+		splx(spl);
+		kmcache_drain();
+		spl = splhigh();
+		kc = kmcache_mine();
+	}
+	if (kc == NULL) {
+		blocks[n++] = ptr;
+	}
+	else {
+		mag = &kc->kc_mags[blktype];
+		if (mag->km_rounds < mag->km_capacity) {
+			kc->kc_freehits[blktype]++;
+			mag->km_blocks[mag->km_rounds++] = ptr;
+			splx(spl);
+			return;
+		}
+		kc->kc_freemisses[blktype]++;
+		blocks[n++] = ptr;
+		while (n <= mag->km_capacity/2) {
+			blocks[n++] = mag->km_blocks[--mag->km_rounds];
+		}
+	}
+	splx(spl);
+
+	subpage_kfree(blocks, n);
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+#if OPT_KMPROF
+////////////////////////////////////////////////////////////
+//
+// Allocation profiling.
+//
+//    Compiled in with "options kmprof". Every kmalloc is charged to
+//    its call site (the return address into the caller) and to its
+//    size class, with whole-page allocations as one more class. For
+//    each we keep allocation and free counts, the bytes currently
+//    allocated, and the most ever allocated at once. Bytes are what
+//    the block actually takes up, not what was asked for.
+//
+//    To charge a kfree back to the right call site we remember every
+//    live block in a hash table. Both tables are fixed-size arrays,
+//    since they can't use kmalloc; once one fills up, further
+//    allocations are counted as untracked and otherwise ignored.
+//
+//    Use the "kmp" menu command (kheap_printprofile) to see the
+//    results. The site addresses can be turned into function names
+//    with os161-addr2line.
+//
+
+#define KMPROF_NSITES    256
+#define KMPROF_NBLOCKS   2048
+#define KMPROF_NBUCKETS  512
+#define KMPROF_NOBLOCK   0xffff
+#define KMPROF_NCLASSES  (NSIZES+1)	/* plus whole pages */
+
+struct kmprof_count {
+	unsigned kp_nallocs;
+	unsigned kp_nfrees;
+	size_t kp_live;			/* bytes allocated now */
+	size_t kp_peak;			/* most bytes ever allocated */
+};
+
+struct kmprof_site {
+	vaddr_t ks_pc;			/* 0 if slot unused */
+	struct kmprof_count ks_count;
+};
+
+struct kmprof_block {
+	void *kb_ptr;
+	uint32_t kb_size;
+	uint16_t kb_site;		/* index into kmprof_sites */
+	uint16_t kb_next;		/* next in bucket or free list */
+};
+
+static struct kmprof_site kmprof_sites[KMPROF_NSITES];
+static struct kmprof_count kmprof_classes[KMPROF_NCLASSES];
+static struct kmprof_block kmprof_blocks[KMPROF_NBLOCKS];
+static uint16_t kmprof_buckets[KMPROF_NBUCKETS];
+static uint16_t kmprof_freeblocks;
+static bool kmprof_ready;
+static unsigned kmprof_untracked;
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+
+#define KMPROF_HASH(ptr) ((((vaddr_t)(ptr)) >> 4) % KMPROF_NBUCKETS)
+
+/*
+ * Set up the free list and buckets. The tables are in BSS, so all
+ * that's needed is to chain the blocks and mark the buckets empty.
+ */
+static
+void
+kmprof_init(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_lock));
+
+	for (i=0; i<KMPROF_NBLOCKS; i++) {
+		kmprof_blocks[i].kb_next =
+			(i+1 < KMPROF_NBLOCKS) ? i+1 : KMPROF_NOBLOCK;
+	}
+	kmprof_freeblocks = 0;
+	for (i=0; i<KMPROF_NBUCKETS; i++) {
+		kmprof_buckets[i] = KMPROF_NOBLOCK;
+	}
+	kmprof_ready = true;
+}
+
+static
+void
+kmprof_charge(struct kmprof_count *kp, size_t size)
+{
+	kp->kp_nallocs++;
+	kp->kp_live += size;
+	if (kp->kp_live > kp->kp_peak) {
+		kp->kp_peak = kp->kp_live;
+	}
+}
+
+static
+void
+kmprof_uncharge(struct kmprof_count *kp, size_t size)
+{
+	KASSERT(kp->kp_live >= size);
+	kp->kp_nfrees++;
+	kp->kp_live -= size;
+}
+
+/*
+ * Find the site slot for PC, claiming a free one if it's new.
+ * Returns KMPROF_NSITES if the table is full.
+ */
+static
+unsigned
+kmprof_findsite(vaddr_t pc)
+{
+	unsigned i, start;
+
+	start = (pc >> 2) % KMPROF_NSITES;
+	i = start;
+	do {
+		if (kmprof_sites[i].ks_pc == pc) {
+			return i;
+		}
+		if (kmprof_sites[i].ks_pc == 0) {
+			kmprof_sites[i].ks_pc = pc;
+			return i;
+		}
+		i = (i+1) % KMPROF_NSITES;
+	} while (i != start);
+	return KMPROF_NSITES;
+}
+
+/*
+ * Record that PC allocated PTR, which takes up SIZE bytes in size
+ * class CLASS.
+ */
+static
+void
+kmprof_alloc(void *ptr, size_t size, unsigned class, vaddr_t pc)
+{
+	struct kmprof_block *kb;
+	unsigned site, ix;
+
+	KASSERT(class < KMPROF_NCLASSES);
+
+	spinlock_acquire(&kmprof_lock);
+	if (!kmprof_ready) {
+		kmprof_init();
+	}
+
+	site = kmprof_findsite(pc);
+	if (site == KMPROF_NSITES || kmprof_freeblocks == KMPROF_NOBLOCK) {
+		kmprof_untracked++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	ix = kmprof_freeblocks;
+	kb = &kmprof_blocks[ix];
+	kmprof_freeblocks = kb->kb_next;
+
+	kb->kb_ptr = ptr;
+	kb->kb_size = size;
+	kb->kb_site = site;
+	kb->kb_next = kmprof_buckets[KMPROF_HASH(ptr)];
+	kmprof_buckets[KMPROF_HASH(ptr)] = ix;
+
+	kmprof_charge(&kmprof_sites[site].ks_count, size);
+	kmprof_charge(&kmprof_classes[class], size);
+
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * Record that PTR is being freed. Blocks we never tracked are ignored.
+ */
+static
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_block *kb;
+	uint16_t *ixp, ix;
+	unsigned class;
+
+	spinlock_acquire(&kmprof_lock);
+	if (!kmprof_ready) {
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	for (ixp = &kmprof_buckets[KMPROF_HASH(ptr)];
+	     *ixp != KMPROF_NOBLOCK;
+	     ixp = &kmprof_blocks[*ixp].kb_next) {
+		kb = &kmprof_blocks[*ixp];
+		if (kb->kb_ptr != ptr) {
+			continue;
+		}
+
+		if (kb->kb_size > LARGEST_SUBPAGE_SIZE) {
+			class = NSIZES;
+		}
+		else {
+			class = blocktype(kb->kb_size);
+		}
+		kmprof_uncharge(&kmprof_sites[kb->kb_site].ks_count,
+				kb->kb_size);
+		kmprof_uncharge(&kmprof_classes[class], kb->kb_size);
+
+		/* unhook and put on the free list */
+		ix = *ixp;
+		*ixp = kb->kb_next;
+		kb->kb_ptr = NULL;
+		kb->kb_next = kmprof_freeblocks;
+		kmprof_freeblocks = ix;
+		break;
+	}
+
+	spinlock_release(&kmprof_lock);
+}
+
+/* A copy of the tables, to print from without holding kmprof_lock */
+struct kmprof_snapshot {
+	struct kmprof_site kss_sites[KMPROF_NSITES];
+	struct kmprof_count kss_classes[KMPROF_NCLASSES];
+	unsigned kss_untracked;
+};
+
+void
+kheap_printprofile(void)
+{
+	struct kmprof_snapshot *snap;
+	struct kmprof_site *ks;
+	bool done[KMPROF_NSITES];
+	unsigned i, best;
+
+	snap = kmalloc(sizeof(*snap));
+	if (snap == NULL) {
+		kprintf("kheap_printprofile: Out of memory\n");
+		return;
+	}
+
+	spinlock_acquire(&kmprof_lock);
+	memcpy(snap->kss_sites, kmprof_sites, sizeof(kmprof_sites));
+	memcpy(snap->kss_classes, kmprof_classes, sizeof(kmprof_classes));
+	snap->kss_untracked = kmprof_untracked;
+	spinlock_release(&kmprof_lock);
+
+	kprintf("kmalloc profile by size class:\n");
+	kprintf("   %-8s %10s %10s %10s %10s\n",
+		"size", "allocs", "frees", "live", "peak");
+	for (i=0; i<KMPROF_NCLASSES; i++) {
+		struct kmprof_count *kp = &snap->kss_classes[i];
+
+		if (i < NSIZES) {
+			kprintf("   %-8lu", (unsigned long) sizes[i]);
+		}
+		else {
+			kprintf("   %-8s", "pages");
+		}
+		kprintf(" %10u %10u %10lu %10lu\n", kp->kp_nallocs,
+			kp->kp_nfrees, (unsigned long) kp->kp_live,
+			(unsigned long) kp->kp_peak);
+	}
+
+	/* Sites, biggest live total first */
+	kprintf("kmalloc profile by call site:\n");
+	kprintf("   %-10s %10s %10s %10s %10s\n",
+		"site", "allocs", "frees", "live", "peak");
+	for (i=0; i<KMPROF_NSITES; i++) {
+		done[i] = (snap->kss_sites[i].ks_pc == 0);
+	}
+	for (;;) {
+		best = KMPROF_NSITES;
+		for (i=0; i<KMPROF_NSITES; i++) {
+			if (done[i]) {
+				continue;
+			}
+			if (best == KMPROF_NSITES ||
+			    snap->kss_sites[i].ks_count.kp_live >
+			    snap->kss_sites[best].ks_count.kp_live) {
+				best = i;
+			}
+		}
+		if (best == KMPROF_NSITES) {
+			break;
+		}
+		done[best] = true;
+		ks = &snap->kss_sites[best];
+		kprintf("   0x%08lx %10u %10u %10lu %10lu\n",
+			(unsigned long) ks->ks_pc,
+			ks->ks_count.kp_nallocs, ks->ks_count.kp_nfrees,
+			(unsigned long) ks->ks_count.kp_live,
+			(unsigned long) ks->ks_count.kp_peak);
+	}
+	kprintf("%u allocations not tracked (tables full)\n",
+		snap->kss_untracked);
+
+	kfree(snap);
+}
+
+#else
+
+void
+kheap_printprofile(void)
+{
+	kprintf("kmalloc profiling is not compiled in; "
+		"rebuild with \"options kmprof\"\n");
+}
+
+#endif /* OPT_KMPROF */
+
+/*
+ * Set up the magazines for cpu number CPUNUM. Called from cpu_create.
+ * A cpu we can't set up for just goes to the shared lists every time.
+ */
+void
+kmalloc_cpuinit(unsigned cpunum)
+{
+	struct kmcache *kc;
+	unsigned i, cap;
+
+	if (cpunum >= KMCACHE_MAXCPUS) {
+		return;
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return;
+	}
+
+	for (i=0; i<NSIZES; i++) {
+		cap = PAGE_SIZE / (2*sizes[i]);
+		if (cap > KMAG_MAXROUNDS) {
+			cap = KMAG_MAXROUNDS;
+		}
+		if (cap < 2) {
+			cap = 2;
+		}
+		kc->kc_mags[i].km_rounds = 0;
+		kc->kc_mags[i].km_capacity = cap;
+		kc->kc_allochits[i] = 0;
+		kc->kc_allocmisses[i] = 0;
+		kc->kc_freehits[i] = 0;
+		kc->kc_freemisses[i] = 0;
+	}
+	kc->kc_trim = false;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(kmcaches[cpunum] == NULL);
+	kmcaches[cpunum] = kc;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Hand the blocks in the per-cpu magazines back to the shared lists,
+ * so that pages held only by cached blocks can be released. The VM
+ * system calls this when it runs short of pages.
+ *
+ * The current cpu's magazines are emptied right away. The other
+ * cpus are asked to empty theirs, which they do on their next kmalloc
+ * or kfree. That may be much later, or never for a cpu that stays
+ * idle, so the caller can only count on getting back this cpu's.
+ */
+void
+kmalloc_trim(void)
+{
+	unsigned i;
+
+	for (i=0; i<KMCACHE_MAXCPUS; i++) {
+		if (kmcaches[i] != NULL) {
+			kmcaches[i]->kc_trim = true;
+		}
+	}
+	kmcache_drain();
+}
+
 void *
 kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
+	if (sz>LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -612,23 +1468,72 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
+#if OPT_KMPROF
+		kmprof_alloc((void *)address, npages*PAGE_SIZE, NSIZES,
+			     (vaddr_t)__builtin_return_address(0));
+#endif
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+#if OPT_KMPROF
+	{
+		unsigned blktype = blocktype(sz);
+		void *ptr = kmcache_alloc(blktype);
+
+		if (ptr != NULL) {
+			kmprof_alloc(ptr, sizes[blktype], blktype,
+				     (vaddr_t)__builtin_return_address(0));
+		}
+		return ptr;
+	}
+#else
+	return kmcache_alloc(blocktype(sz));
+#endif
 }
 
 void
 kfree(void *ptr)
 {
+	struct pageref **slot;
+	struct pageref *pr;
+	unsigned blktype;
+	vaddr_t ptraddr, offset;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+#if OPT_KMPROF
+	kmprof_free(ptr);
+#endif
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * If the page isn't in the table, it isn't a subpage page, so
+	 * this must be a big allocation.
 	 */
-	if (ptr == NULL) {
+	ptraddr = (vaddr_t)ptr;
+	slot = kpage_lookup(ptraddr, false);
+	pr = (slot == NULL) ? NULL : *slot;
+	if (pr == NULL) {
+		KASSERT(ptraddr%PAGE_SIZE==0);
+		free_kpages(ptraddr);
 		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
 	}
-}
 
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype<NSIZES);
+	offset = ptraddr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset >= SLABSIZE(blktype) || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	kmcache_free(blktype, ptr);
+}
@@ -0,0 +1,246 @@
+/*
+ * Object caches. See kmem.h for the interface.
+ *
+ * Each slab is one page from alloc_kpages. The slab header sits at the
+ * start of the page, so the slab an object belongs to is found by
+ * masking its address. Free objects are chained through a link word
+ * placed after each object rather than inside it, so that freeing an
+ * object does not disturb its constructed state.
+ *
+ * Slabs with free objects are kept on the cache's partial list; full
+ * slabs are on no list. We keep at most one slab with nothing in use,
+ * so that a cache that shrinks and grows again does not construct and
+ * destroy a whole slab each time. Constructors and destructors can
+ * sleep, so they are never called with kc_lock held.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem.h>
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;	/* cache we belong to */
+	struct kmem_slab *ks_next;	/* on kc_partial */
+	void *ks_free;			/* first free object */
+	unsigned ks_nfree;		/* number of free objects */
+};
+
+#define KMEM_ALIGN 8
+#define KMEM_ROUNDUP(x) (((x) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+#define KMEM_FIRSTOBJ KMEM_ROUNDUP(sizeof(struct kmem_slab))
+
+/* The link word of object OBJ in cache KC */
+#define KMEM_LINK(kc, obj) \
+	(*(void **)((char *)(obj) + (kc)->kc_stride - sizeof(void *)))
+
+/* All caches that have ever made a slab, for kmem_printstats */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Work out the layout of a cache's slabs the first time it is used,
+ * and add it to the list of caches.
+ */
+static
+void
+kmem_cache_setup(struct kmem_cache *kc)
+{
+	size_t stride;
+
+	stride = KMEM_ROUNDUP(kc->kc_size + sizeof(void *));
+	if (KMEM_FIRSTOBJ + stride > PAGE_SIZE) {
+		panic("kmem: %s: objects of size %lu do not fit in a slab\n",
+		      kc->kc_name, (unsigned long)kc->kc_size);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_stride == 0) {
+		kc->kc_perslab = (PAGE_SIZE - KMEM_FIRSTOBJ) / stride;
+		kc->kc_stride = stride;
+
+		spinlock_acquire(&kmem_caches_lock);
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		spinlock_release(&kmem_caches_lock);
+	}
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Run the destructor, if any, on the first N objects of SLAB, and give
+ * the page back.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab, unsigned n)
+{
+	char *obj;
+	unsigned i;
+
+	if (kc->kc_dtor != NULL) {
+		obj = (char *)slab + KMEM_FIRSTOBJ;
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(obj);
+			obj += kc->kc_stride;
+		}
+	}
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Make a new slab with every object constructed and free. Called
+ * without kc_lock. Returns NULL if out of memory or if a constructor
+ * fails.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	vaddr_t page;
+	char *obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	slab = (struct kmem_slab *)page;
+	slab->ks_cache = kc;
+	slab->ks_next = NULL;
+	slab->ks_free = NULL;
+	slab->ks_nfree = kc->kc_perslab;
+
+	/* Build the freelist backwards so objects go out in address order */
+	obj = (char *)page + KMEM_FIRSTOBJ + kc->kc_perslab * kc->kc_stride;
+	for (i=0; i<kc->kc_perslab; i++) {
+		obj -= kc->kc_stride;
+		if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+			/* undo the ones already built, which follow this one */
+			for (; i>0; i--) {
+				obj += kc->kc_stride;
+				if (kc->kc_dtor != NULL) {
+					kc->kc_dtor(obj);
+				}
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		KMEM_LINK(kc, obj) = slab->ks_free;
+		slab->ks_free = obj;
+	}
+
+	return slab;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj;
+
+	if (kc->kc_stride == 0) {
+		kmem_cache_setup(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL) {
+		spinlock_release(&kc->kc_lock);
+		slab = kmem_slab_create(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab->ks_next = kc->kc_partial;
+		kc->kc_partial = slab;
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	slab = kc->kc_partial;
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(slab->ks_nfree > 0);
+	if (slab->ks_nfree == kc->kc_perslab) {
+		kc->kc_nempty--;
+	}
+
+	obj = slab->ks_free;
+	slab->ks_free = KMEM_LINK(kc, obj);
+	slab->ks_nfree--;
+	if (slab->ks_nfree == 0) {
+		/* full; off the partial list */
+		kc->kc_partial = slab->ks_next;
+		slab->ks_next = NULL;
+	}
+	kc->kc_inuse++;
+
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab, **pp;
+
+	KASSERT(obj != NULL);
+	slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(((vaddr_t)obj - (vaddr_t)slab - KMEM_FIRSTOBJ)
+		% kc->kc_stride == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KMEM_LINK(kc, obj) = slab->ks_free;
+	slab->ks_free = obj;
+	slab->ks_nfree++;
+	KASSERT(slab->ks_nfree <= kc->kc_perslab);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+
+	if (slab->ks_nfree == 1) {
+		/* was full; back on the partial list */
+		slab->ks_next = kc->kc_partial;
+		kc->kc_partial = slab;
+	}
+
+	if (slab->ks_nfree == kc->kc_perslab) {
+		if (kc->kc_nempty == 0) {
+			/* keep it as the spare */
+			kc->kc_nempty++;
+		}
+		else {
+			for (pp = &kc->kc_partial; *pp != slab;
+			     pp = &(*pp)->ks_next) {
+				KASSERT(*pp != NULL);
+			}
+			*pp = slab->ks_next;
+			kc->kc_nslabs--;
+			spinlock_release(&kc->kc_lock);
+
+			kmem_slab_destroy(kc, slab, kc->kc_perslab);
+			return;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("   %-16s size %-4lu  %2u/slab  %u slabs  %u in use\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_perslab, kc->kc_nslabs, kc->kc_inuse);
+	}
+
+	spinlock_release(&kmem_caches_lock);
+}
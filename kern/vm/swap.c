@@ -0,0 +1,178 @@
+/*
+ * Swap space management. See swap.h for the interface.
+ *
+ * Slot usage is kept in a bitmap; reference counts for the slots in
+ * use are kept in a parallel array. Both are protected by a spinlock
+ * so that slots can be released from anywhere, including places
+ * where the coremap lock is held. Disk I/O is done without the lock;
+ * the disk driver serializes requests itself.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode;	/* NULL if swap is disabled */
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refcounts;	/* references to each slot */
+static unsigned swap_nslots;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: cannot open %s: %s; swapping disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: cannot stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; swapping disabled\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	swap_refcounts = kmalloc(swap_nslots * sizeof(uint16_t));
+	if (swap_map == NULL || swap_refcounts == NULL) {
+		panic("swap: out of memory for %u slots\n", swap_nslots);
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refcounts[i] = 0;
+	}
+
+	kprintf("swap: %uk on %s\n", swap_nslots * PAGE_SIZE / 1024,
+		SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		KASSERT(swap_refcounts[*slot] == 0);
+		swap_refcounts[*slot] = 1;
+	}
+	spinlock_release(&swap_lock);
+
+	/* bitmap_alloc says ENOSPC; to our callers this is running out of memory */
+	return result ? ENOMEM : 0;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcounts[slot] > 0);
+	KASSERT(swap_refcounts[slot] < 0xffff);
+	swap_refcounts[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcounts[slot] > 0);
+	swap_refcounts[slot]--;
+	if (swap_refcounts[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Common code for swap_read and swap_write.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("swap: short %s on slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_READ);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	}
+	return result;
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
@@ -33,6 +33,8 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Shootdown IPIs",
+ /* 11 */ "TLB Shootdown Invalidations",
 };
 
 
@@ -0,0 +1,43 @@
+#ifndef _SYNCH_H_
+#define _SYNCH_H_
+
+/*
+ * Mutexes and condition variables for threads of one process.
+ *
+ * Both keep their state in a single int in user memory and change it
+ * with atomic instructions; they only make a system call (futex_wait
+ * or futex_wake, see unistd.h) to sleep when they have to wait, or to
+ * wake someone who is waiting. A mutex nobody else wants costs no
+ * system calls at all.
+ *
+ * A mutex or condition variable may be set up with its _init function
+ * or with MUTEX_INITIALIZER/COND_INITIALIZER. Neither needs to be
+ * destroyed.
+ *
+ * As usual, cond_wait must be called with the mutex held, and may
+ * return without having been signalled, so call it in a loop that
+ * checks the condition.
+ */
+
+struct mutex {
+	volatile int m_state;	/* 0 free, 1 held, 2 held and wanted */
+};
+
+struct cond {
+	volatile int c_seq;	/* bumped by every signal/broadcast */
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+int mutex_trylock(struct mutex *m);	/* 1 if it got the lock */
+void mutex_unlock(struct mutex *m);
+
+void cond_init(struct cond *c);
+void cond_wait(struct cond *c, struct mutex *m);
+void cond_signal(struct cond *c);
+void cond_broadcast(struct cond *c);
+
+#endif /* _SYNCH_H_ */
@@ -153,7 +153,14 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *request, struct timespec *remaining);
 int __getcwd(char *buf, size_t buflen);
+int __thread_create(void (*start)(int (*)(void *), void *),
+		    int (*func)(void *), void *arg);
+__DEAD void thread_exit(int status);
+int thread_join(int tid, int *status);
+int futex_wait(volatile int *addr, int val, const struct timespec *timeout);
+int futex_wake(volatile int *addr, int count);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -163,5 +170,6 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(int (*func)(void *), void *arg);	/* calls __thread_create */
 
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,166 @@
+/*
+ * Mutexes and condition variables. See synch.h for the interface.
+ *
+ * The mutex is the usual three-state futex lock: 0 is free, 1 is held
+ * with nobody waiting, and 2 is held with (maybe) someone waiting. A
+ * thread that finds the lock held sets it to 2 before sleeping, so
+ * the holder knows to make a wake call when it unlocks; a lock that
+ * never reached 2 is unlocked without one.
+ *
+ * The condition variable is a sequence number. A waiter notes it
+ * before giving up the mutex and sleeps only if it hasn't changed
+ * since, so a signal sent in between is not lost.
+ */
+
+#include <unistd.h>
+#include <synch.h>
+
+/* A futex_wake count that wakes everyone */
+#define WAKE_ALL 0x7fffffff
+
+/*
+ * Atomic compare-and-swap using LL/SC: if *P is OLD, make it NEW.
+ * Returns what *P was, so it worked if that's OLD.
+ */
+static
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int x;
+	int y;
+
+	/*
+	 * After the SC, Y is 1 if the store happened and 0 if something
+	 * else got at *P first, in which case try again. If *P wasn't
+	 * OLD we skip the SC; X tells the caller so.
+	 */
+	do {
+		y = new;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slots */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"nop;"			/*   (load delay) */
+			"bne %0, %3, 1f;"	/*   if (x != old) skip sc */
+			"nop;"			/*   (branch delay) */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p), "r" (old)
+			: "memory");
+	} while (x == old && y == 0);
+
+	return x;
+}
+
+/*
+ * Set *P to NEW and return what it was.
+ */
+static
+int
+atomic_swap(volatile int *p, int new)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, new) != old);
+	return old;
+}
+
+////////////////////////////////////////////////////////////
+// mutex
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+/*
+ * Wait for the lock, marking it wanted. Used once a thread has failed
+ * to get it the easy way, and by cond_wait, whose caller may well not
+ * be the only one after the lock.
+ */
+static
+void
+mutex_lock_slow(struct mutex *m)
+{
+	while (atomic_swap(&m->m_state, 2) != 0) {
+		/* Fails at once if it's no longer 2; that's fine. */
+		futex_wait(&m->m_state, 2, NULL);
+	}
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	if (atomic_cas(&m->m_state, 0, 1) != 0) {
+		mutex_lock_slow(m);
+	}
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return atomic_cas(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (atomic_swap(&m->m_state, 0) == 2) {
+		futex_wake(&m->m_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// cond
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq;
+
+	seq = c->c_seq;
+	mutex_unlock(m);
+	futex_wait(&c->c_seq, seq, NULL);
+	mutex_lock_slow(m);
+}
+
+/*
+ * Move the sequence number on, so that a thread about to wait sees
+ * it changed and doesn't.
+ */
+static
+void
+cond_bump(struct cond *c)
+{
+	int seq;
+
+	do {
+		seq = c->c_seq;
+	} while (atomic_cas(&c->c_seq, seq, (int)((unsigned)seq + 1)) != seq);
+}
+
+void
+cond_signal(struct cond *c)
+{
+	cond_bump(c);
+	futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	cond_bump(c);
+	futex_wake(&c->c_seq, WAKE_ALL);
+}
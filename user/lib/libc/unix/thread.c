@@ -0,0 +1,21 @@
+/*
+ * Threads. The kernel starts a new thread at a function of our
+ * choosing, with the thread's function and argument as its first two
+ * arguments; thread_start runs the function and makes sure the thread
+ * exits afterwards, since it has nothing to return to.
+ */
+
+#include <unistd.h>
+
+static
+void
+thread_start(int (*func)(void *), void *arg)
+{
+	thread_exit(func(arg));
+}
+
+int
+thread_create(int (*func)(void *), void *arg)
+{
+	return __thread_create(thread_start, func, arg);
+}
@@ -0,0 +1,119 @@
+/*
+ * sleeptest - test nanosleep.
+ *
+ *    1. Sleeps of various lengths must last at least as long as asked
+ *       for, measured with __time, and report no time remaining.
+ *    2. A tv_nsec outside 0..999999999 must be refused with EINVAL,
+ *       without sleeping.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NSEC_PER_SEC	1000000000
+
+static const struct timespec sleeps[] = {
+	{ 0, 0 },
+	{ 0, 1 },		/* rounds up to a microsecond */
+	{ 0, 10000000 },	/* 10 ms */
+	{ 0, 250000000 },	/* 250 ms */
+	{ 1, 100000000 },	/* 1.1 s */
+};
+#define NSLEEPS (sizeof(sleeps) / sizeof(sleeps[0]))
+
+/*
+ * Nanoseconds from (S1, NS1) to (S2, NS2).
+ */
+static
+long long
+elapsed(time_t s1, unsigned long ns1, time_t s2, unsigned long ns2)
+{
+	return (long long)(s2 - s1) * NSEC_PER_SEC + (long long)ns2 - ns1;
+}
+
+static
+void
+test_duration(void)
+{
+	struct timespec rem;
+	time_t s1, s2;
+	unsigned long ns1, ns2;
+	long long want, took;
+	unsigned i;
+
+	printf("nanosleep: sleeps last at least as long as asked\n");
+
+	for (i=0; i<NSLEEPS; i++) {
+		want = (long long)sleeps[i].tv_sec * NSEC_PER_SEC
+			+ sleeps[i].tv_nsec;
+		rem.tv_sec = -1;
+		rem.tv_nsec = -1;
+
+		__time(&s1, &ns1);
+		if (nanosleep(&sleeps[i], &rem) != 0) {
+			err(1, "nanosleep: FAILED: %lld ns", want);
+		}
+		__time(&s2, &ns2);
+
+		took = elapsed(s1, ns1, s2, ns2);
+		if (took < want) {
+			errx(1, "nanosleep: FAILED: asked for %lld ns, "
+			     "slept %lld ns", want, took);
+		}
+		if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+			errx(1, "nanosleep: FAILED: %lld ns sleep left "
+			     "%lld s %ld ns remaining", want,
+			     (long long)rem.tv_sec, (long)rem.tv_nsec);
+		}
+		printf("  asked %lld ns, slept %lld ns\n", want, took);
+	}
+	printf("nanosleep: passed\n");
+}
+
+static
+void
+test_badnsec(void)
+{
+	struct timespec ts;
+	time_t s1, s2;
+	unsigned long ns1, ns2;
+	int result;
+
+	printf("nanosleep: bad tv_nsec is refused\n");
+
+	/* A second's worth, were it accepted, so a sleep would show */
+	ts.tv_sec = 0;
+	ts.tv_nsec = NSEC_PER_SEC;
+	__time(&s1, &ns1);
+	result = nanosleep(&ts, NULL);
+	__time(&s2, &ns2);
+	if (result != -1 || errno != EINVAL) {
+		errx(1, "nanosleep: FAILED: tv_nsec %ld returned %d "
+		     "(errno %d), expected EINVAL", (long)ts.tv_nsec,
+		     result, errno);
+	}
+	if (elapsed(s1, ns1, s2, ns2) >= NSEC_PER_SEC) {
+		errx(1, "nanosleep: FAILED: slept before refusing "
+		     "tv_nsec %ld", (long)ts.tv_nsec);
+	}
+
+	ts.tv_nsec = -1;
+	result = nanosleep(&ts, NULL);
+	if (result != -1 || errno != EINVAL) {
+		errx(1, "nanosleep: FAILED: tv_nsec %ld returned %d "
+		     "(errno %d), expected EINVAL", (long)ts.tv_nsec,
+		     result, errno);
+	}
+	printf("nanosleep: passed\n");
+}
+
+int
+main(void)
+{
+	test_badnsec();
+	test_duration();
+	printf("sleeptest: all tests passed\n");
+	return 0;
+}
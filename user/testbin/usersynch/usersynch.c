@@ -0,0 +1,171 @@
+/*
+ * usersynch - test futex_wait/futex_wake and the libc mutexes and
+ * condition variables built on them.
+ *
+ *    1. Several threads each add to a shared counter many times under
+ *       a mutex; the total must come out exact.
+ *    2. Two threads take turns, handing over with a condition
+ *       variable, a fixed number of times.
+ *    3. futex_wait must refuse to sleep if the word has changed, and
+ *       must give up with ETIMEDOUT when its timeout runs out.
+ *
+ * Needs thread_create, which comes with user-level threads.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <synch.h>
+
+#define NTHREADS	4
+#define NINCS		20000
+#define NROUNDS		1000
+
+static struct mutex countlock = MUTEX_INITIALIZER;
+static volatile int count;
+
+static struct mutex turnlock = MUTEX_INITIALIZER;
+static struct cond turncv = COND_INITIALIZER;
+static volatile int turn;
+static volatile int turnstaken[2];
+
+static
+int
+counter(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i=0; i<NINCS; i++) {
+		mutex_lock(&countlock);
+		count++;
+		mutex_unlock(&countlock);
+	}
+	return 0;
+}
+
+static
+void
+test_mutex(void)
+{
+	int tids[NTHREADS];
+	int i;
+
+	printf("mutex: %d threads, %d increments each\n", NTHREADS, NINCS);
+
+	count = 0;
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(counter, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	if (count != NTHREADS * NINCS) {
+		errx(1, "mutex: FAILED: count is %d, expected %d",
+		     count, NTHREADS * NINCS);
+	}
+	printf("mutex: passed\n");
+}
+
+/*
+ * Wait for our turn (0 or 1, passed as the argument), take it, and
+ * hand over to the other thread.
+ */
+static
+int
+pingpong(void *arg)
+{
+	int me = (int)arg;
+	int i;
+
+	for (i=0; i<NROUNDS; i++) {
+		mutex_lock(&turnlock);
+		while (turn != me) {
+			cond_wait(&turncv, &turnlock);
+		}
+		turnstaken[me]++;
+		turn = !me;
+		cond_signal(&turncv);
+		mutex_unlock(&turnlock);
+	}
+	return 0;
+}
+
+static
+void
+test_cond(void)
+{
+	int tids[2];
+	int i;
+
+	printf("cond: ping-pong, %d rounds\n", NROUNDS);
+
+	turn = 0;
+	turnstaken[0] = turnstaken[1] = 0;
+	for (i=0; i<2; i++) {
+		tids[i] = thread_create(pingpong, (void *)i);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<2; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	if (turnstaken[0] != NROUNDS || turnstaken[1] != NROUNDS ||
+	    turn != 0) {
+		errx(1, "cond: FAILED: turns %d and %d, expected %d each",
+		     turnstaken[0], turnstaken[1], NROUNDS);
+	}
+	printf("cond: passed\n");
+}
+
+static
+void
+test_timeout(void)
+{
+	static volatile int word;
+	struct timespec ts;
+	int result;
+
+	printf("futex: value check and timeout\n");
+
+	word = 1;
+	result = futex_wait(&word, 0, NULL);
+	if (result != -1 || errno != EAGAIN) {
+		errx(1, "futex: FAILED: waiting on a changed value "
+		     "returned %d (errno %d), expected EAGAIN", result, errno);
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;	/* 10 ms */
+	result = futex_wait(&word, 1, &ts);
+	if (result != -1 || errno != ETIMEDOUT) {
+		errx(1, "futex: FAILED: timed wait returned %d (errno %d), "
+		     "expected ETIMEDOUT", result, errno);
+	}
+
+	if (futex_wake(&word, 1) != 0) {
+		errx(1, "futex: FAILED: woke a waiter that wasn't there");
+	}
+	printf("futex: passed\n");
+}
+
+int
+main(void)
+{
+	test_timeout();
+	test_mutex();
+	test_cond();
+	printf("usersynch: all tests passed\n");
+	return 0;
+}